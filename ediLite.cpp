@@ -9,31 +9,459 @@
 #include <stdio.h>     // For standard I/O functions
 #include <string>      // For string handling
 #include <vector>      // For vector data structure
+#include <algorithm>   // For std::upper_bound
+#include <bitset>      // For regex byte sets
+#include <map>         // For interning regex DFA states
+#include <deque>       // For the undo history
 #include <time.h>      // For time handling
 #include <cstdarg>     // For variadic arguments
 #include <fstream>     // For file handling
+#include <sys/uio.h>   // For writev() when saving
+#include <libgen.h>    // For dirname()
 #include <signal.h>    // Add this for signal handling
+#include <fcntl.h>     // For open()
+#include <poll.h>      // For checking whether more input is waiting
+#include <sys/mman.h>  // For mmap() of large files
+#include <sys/stat.h>  // For fstat()
+#include <sys/resource.h> // For the peak memory reported by --bench
+#include <atomic>      // For state shared with the highlighting thread
+#include <thread>      // For the background highlighting thread
+#include <stdint.h>    // For the trigram bitmaps
+#include <new>         // For counting heap allocations
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For the SSE2/AVX2 search kernels
+#endif
+#ifdef __linux__
+#include <sys/signalfd.h> // For taking SIGWINCH in the event loop
+#include <sys/timerfd.h>  // For waking the event loop on a deadline
+#endif
 
 /*** defines ***/
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define EDILITE_VERSION "0.0.1"
 #define EDILITE_TAB_STOP 8
 #define EDILITE_QUIT_TIMES 3
+#define EDILITE_ESC_TIMEOUT 100     // Milliseconds to wait for the rest of an escape sequence
+#define EDILITE_PASTE_TIMEOUT 500   // Milliseconds a paste may stall before it is taken as ended
+#define EDILITE_RESIZE_DELAY 30     // Milliseconds a resize waits for more before redrawing
+#define EDILITE_MSG_TIMEOUT 5       // Seconds a status message stays up
+#define EDILITE_HL_CHECKPOINT 256 // Columns between saved lexer states on long rows
+#define EDILITE_HL_BLOCK 64       // Mapped lines per cached comment state transfer
+#define EDILITE_HL_LOOKAHEAD 16   // Rows below the screen highlighted ahead of scrolling
+#define EDILITE_LOADED_MAX 1024   // Rows loaded off screen before unedited ones go back to the mapping
+#define EDILITE_LONG_ROW (1 << 16)  // Rows this long and without tabs are kept in chunks
+#define EDILITE_ROW_CHUNK (1 << 12) // Chars per chunk of a long row
+#define EDILITE_ROW_SPANS 8         // Highlight runs a short row keeps in place of an hl array
+#define EDILITE_ROW_INLINE 64       // Bytes of text a row holds in itself before taking a block
+#define EDILITE_SLAB (1 << 16)      // Bytes malloced at a time for row memory blocks
+#define EDILITE_SLAB_MIN 16         // Smallest block of row memory
+#define EDILITE_SLAB_STEPS 512      // Block sizes go up in steps of EDILITE_SLAB_MIN to here, then double
+#define EDILITE_SLAB_MAX 4096       // Largest block of row memory; bigger ones are malloced
+#define EDILITE_SLAB_CLASSES 35     // Block sizes from EDILITE_SLAB_MIN to EDILITE_SLAB_MAX
+#define EDILITE_FIND_MAX (1 << 22) // Most matches kept in the search index
+#define EDILITE_FIND_SLICE 8        // Milliseconds of search indexing done per key, or per wakeup while idle
+#define EDILITE_FIND_BATCH (1 << 20) // Most bytes each core searches between looks at the clock
+#define EDILITE_FIND_SEGMENT (1 << 16) // Bytes of mapped lines searched as one piece
+#define EDILITE_RE_INSTS 20000      // Largest regex program, after repeats are expanded
+#define EDILITE_RE_STATES 2048      // Regex DFA states cached before the cache is flushed
+#define EDILITE_TRI_MIN (1 << 24)   // Smallest mapped file given a trigram index
+#define EDILITE_TRI_BYTES (1 << 18) // Mapped bytes per trigram index block
+#define EDILITE_TRI_BITS (1 << 16)  // Hashed trigram bits kept per block
+#define EDILITE_SAVE_IOV 1024       // Pieces of the file handed to each writev() on save
+#define EDILITE_JOURNAL_SYNC 1000   // Milliseconds an edit may wait before its journal record is synced
+#define EDILITE_JOURNAL_BUF (1 << 16) // Journal bytes held in memory before they are written
+#ifndef EDILITE_UNDO_MAX
+#define EDILITE_UNDO_MAX (64 << 20) // Bytes of undo history kept; the oldest is dropped first
+#endif
+#define EDILITE_UNDO_CHUNK (1 << 16) // Bytes per block of the undo payload arena, at most EDILITE_UNDO_MAX / 8
+#define EDILITE_PROBE_BITS 4        // Latency buckets per power of two, as a power of two
+#define EDILITE_PROBE_BUCKETS ((65 - EDILITE_PROBE_BITS) << EDILITE_PROBE_BITS)
+#ifndef EDILITE_PROBE_FILE
+#define EDILITE_PROBE_FILE "ediLite.probes" // Where a profiling build writes its latencies on exit
+#endif
+
+#define SCR_LINENO 31      // Cell style of line numbers
+#define SCR_REVERSE 0x20   // Cell style bit for reverse video
+#define SCR_UNKNOWN 0xff   // Cell style of a cell the terminal may show anything in
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+// Character classes, looked up in editorCharClass[]
+#define CC_SEP (1 << 0)      // Ends a word: is_separator()
+#define CC_SEP_CAPS (1 << 1) // Ends an all-caps word: is_separator_caps()
+#define CC_DIGIT (1 << 2)
+#define CC_UPPER (1 << 3)
+
 /** Data */
+// Lexer state at the top of the highlighting loop, saved along long rows so
+// an edit only has to be highlighted again from just before it
+struct hlState
+{
+    int i;                 // Render column the lexer is at
+    int reach;             // Furthest column read by the lexer before this point
+    char prev_sep;         // Previous character was a separator
+    char in_string;        // Quote character of the open string, or 0
+    char in_comment;       // Inside a multi-line comment, 2 for a single-line one
+    unsigned char prev_hl; // Highlight of the previous column
+};
+
+// Where a run of the lexer over part of a long row sits in the row
+struct hlWindow
+{
+    int base;      // Row column of the text's first char
+    int stop;      // The run stops at the first step at or past this column
+    hlState *next; // The state of the last step at or before `stop`
+};
+
+// A stretch of a long row. A tab-free row renders as its own chars, so a
+// chunk only keeps the lexer state it starts from, and its highlighting
+// once it has been drawn.
+struct rowChunk
+{
+    int start;         // First char of the chunk
+    int size;
+    hlState entry;     // State at or before `start` the chunk is lexed from, i -1 if unknown
+    unsigned char *hl; // Highlight of its chars, null until needed
+};
+
+// A run of one highlight in a short row, up to render column `end`
+struct hlSpan
+{
+    uint16_t end;
+    unsigned char hl;
+};
+
+// A tab in a row: its char column, and the render column just after it
+struct rowTab
+{
+    int cx;
+    int rx;
+};
+
 struct erow
 {
-    int idx;             // Row index in the file
+    char *chars;         // Actual characters in the row, with a gap while being edited, or inl
+    char *render;        // Rendered row with tabs converted to spaces
+    unsigned char *hl;   // Highlight attributes for each character, in the block of render
+    hlState *hl_cp;      // Lexer states every EDILITE_HL_CHECKPOINT columns
+    uint64_t tri;        // Trigrams of the row hashed to 64 bits, maybe a few stale
+    rowTab *tabs;        // Tabs in the row in order, null when it has none
+    rowChunk *chunks;    // Chunks of a long row, which then has no render or hl
     int size;            // Size of the row
     int rsize;           // Rendered size (tabs expanded)
-    char *chars;         // Actual characters in the row
-    char *render;        // Rendered row with tabs converted to spaces
-    unsigned char *hl;   // Highlight attributes for each character
-    int hl_open_comment; // Indicates if the row has an open comment
+    int cap;             // Bytes allocated for chars
+    int gap;             // Start of the gap in chars, equal to size when closed
+    int rcap;            // Bytes allocated for render, and as many for hl
+    int hl_ncp;          // Number of saved lexer states
+    int ntabs;
+    int tabcap;
+    int nchunks;
+    signed char hl_open_comment; // Indicates if the row has an open comment, -1 unknown
+    unsigned char hl_stale;      // Comment state coming from above changed since highlighting
+    unsigned char compact;       // Short row without tabs: render is chars, hl is spans
+    unsigned char nspans;
+    hlSpan spans[EDILITE_ROW_SPANS];
+    char inl[EDILITE_ROW_INLINE]; // chars of a short row
+};
+
+// Rows are kept in a treap ordered by position. A node holds either one
+// loaded row or a run of rows that are still only in the mapped file. A
+// loaded row that still matches its mapped line can go back into a run.
+struct rowNode
+{
+    erow row;        // Loaded row; first member, so an erow * is also its node
+    rowNode *left;   // Rows before this node
+    rowNode *right;  // Rows after this node
+    rowNode *parent; // Null for the root
+    unsigned prio;   // Heap priority that keeps the tree balanced
+    int lines;       // Rows held by this node: 1 when loaded, else the run length
+    int count;       // Rows in this subtree
+    int stale;       // Nodes in this subtree whose comment state is out of date
+    int line;        // First mapped line of an unloaded run, -1 once loaded
+    int mapped;      // Mapped line a loaded row was read from, -1 if none
+};
+
+// Thread filling in E.hlblock while the editor waits for keys. It only reads
+// the mapping, which does not change while it runs, and publishes through
+// the atomic block table, so the editor never takes a lock.
+struct hlWorker
+{
+    std::thread thread;
+    std::atomic<bool> stop; // Set when the mapping or the syntax goes away
+    std::atomic<bool> busy; // Set while a key is being handled
+};
+
+// Trigram index of a large mapped file, built on a background thread the
+// same way. Each block of about EDILITE_TRI_BYTES has a bitmap of the
+// trigrams in it hashed to EDILITE_TRI_BITS, and a block missing one of the
+// query's cannot hold a match. A block is only read once it is `built`.
+struct triIndex
+{
+    std::thread thread;
+    std::atomic<bool> stop;
+    std::atomic<bool> busy;
+    std::atomic<size_t> built; // Blocks with a finished bitmap, in order
+    size_t nblocks;
+    size_t *first;             // First mapped line of each block, then E.maplines
+    uint64_t *bits;            // EDILITE_TRI_BITS / 64 words per block
+    bool reported;             // Told the user it is ready
+};
+
+// Keywords of the current syntax in a perfect hash table: no two share a
+// slot, so looking a word up is one hash and one compare
+struct kwSlot
+{
+    const char *word;
+    int len;          // Length without the trailing '|'
+    unsigned char hl; // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+struct kwTable
+{
+    kwSlot *slots;
+    unsigned mask;  // Slot count minus one, a power of two minus one
+    unsigned seed;  // Hash seed found to separate every keyword
+    int maxlen;     // Longest keyword
+};
+
+// Regex patterns compile to a small program that a DFA runs; the DFA's
+// states are sets of program counters, built the first time they are reached
+enum reOp
+{
+    RE_SET,   // Consume a byte in set `x`
+    RE_SPLIT, // Go on at both `x` and `y`
+    RE_JMP,   // Go on at `x`
+    RE_BOL,   // Only at the start of the line
+    RE_EOL,   // Only at the end of the line
+    RE_MATCH
+};
+
+struct reInst
+{
+    int op;
+    int x;
+    int y;
+};
+
+struct reRegex
+{
+    std::vector<std::bitset<256>> sets; // Byte sets used by RE_SET
+    std::vector<reInst> fwd;            // The pattern
+    std::vector<reInst> rev;            // The pattern reversed, to find where matches start
+    std::string lit;                    // Bytes every match contains, to skip lines quickly
+};
+
+struct reDFA
+{
+    const reRegex *re;
+    const std::vector<reInst> *code;
+    bool unanchored;                      // May start a match at any byte
+    std::vector<std::vector<int>> states; // Program counters of each state
+    std::map<std::vector<int>, int> ids;
+    std::vector<int> next;                // 256 transitions per state, -1 until worked out
+    std::vector<char> match;              // State has matched
+    std::vector<char> match_end;          // State matches if the line ends here
+    int start[2];                         // Start state away from / at the line start
+};
+
+// Per thread: the DFAs and where matches start in the current line
+struct reMatcher
+{
+    reDFA fwd;
+    reDFA rev;
+    reDFA any; // Unanchored forward, only to tell which lines match at all
+    std::vector<char> starts;
+};
+
+struct findMatch
+{
+    int row;
+    int col; // Column in chars
+    int len; // Length in chars
+};
+
+// A stretch of rows searched as one piece of text: a loaded row, or a chunk
+// of an unloaded run read straight from the mapping
+struct findSegment
+{
+    int row;     // First row
+    const char *text;
+    size_t size;
+    size_t line; // First mapped line, or (size_t)-1 for a loaded row
+    int lines;
+};
+
+// Every match of the last search query, sorted by position and kept in step
+// with edits, so stepping between matches is a binary search. A query with
+// more than EDILITE_FIND_MAX matches is only counted.
+//
+// The index is built a slice at a time, between keys, so `m` holds the
+// matches up to some point in the file until `done` is set. Narrowing for a
+// longer query checks the entries from `narrow` on first; the segments from
+// `nextseg` on are searched after that.
+struct findIndex
+{
+    char *query;  // Null when there is no index
+    int qlen;
+    int regex;    // Query is a regex
+    reRegex *re;  // Compiled query, null if it did not compile
+    reMatcher *matcher; // Matcher for the editor thread
+    std::vector<reMatcher> matchers; // One per search thread
+    const char *error;  // Why the regex did not compile
+    findMatch *m;
+    int n;        // Matches held in `m`
+    int cap;
+    long total;   // Matches found, more than `n` when not indexed
+    bool done;    // Every match is in, or counted
+    std::vector<findSegment> segs; // Text still to search
+    size_t nextseg;
+    size_t batch;          // Bytes per core in the next batch, fitted to the time batches take
+    int narrow, narrowend; // Entries still to check against a longer query
+    int row, col;          // Match shown last, row -1 if none
+    int seekdir;           // Waiting to show the next (1) or previous (-1) match, else 0
+    int seekrow, seekcol;  // From this position
+};
+
+// Memory for row text, render and tabs: blocks in a few dozen size classes,
+// carved from slabs, with a list of the freed blocks of each class
+struct slabHeap
+{
+    void *free[EDILITE_SLAB_CLASSES]; // Freed blocks, each holding the next
+    char *next;                       // Rest of the newest slab
+    size_t left;
+    size_t bytes;                     // Taken from malloc for slabs
+};
+
+// One character cell of the screen. The style is an HL_* colour, or
+// SCR_LINENO, with SCR_REVERSE for reverse video.
+struct scrCell
+{
+    char c;
+    unsigned char style;
+};
+
+// Escape sequence that sets one foreground colour, looked up once
+struct styleEsc
+{
+    const char *seq;
+    int len;
+};
+
+// Edits since the last save, appended to a swap file next to the file so
+// they can be replayed after a crash. Records are varint encoded and
+// gathered in `buf`; they reach the disk in batches.
+enum journalOp
+{
+    J_INSERT = 1,  // Row, column, then the bytes inserted
+    J_DELETE_CHAR, // Row, column
+    J_TRUNCATE,    // Row, new length
+    J_INSERT_ROW,  // Row, 0, then the row's text
+    J_DELETE_ROW,  // Row, 0
+    J_DELETE,      // Row, column, then the bytes deleted
+    J_INSERT_ROWS, // Row, number of rows, then the rows as a row list
+    J_DELETE_ROWS  // Row, number of rows
+};
+
+struct journalHeader
+{
+    char magic[4];
+    uint64_t size; // The file the records apply to, as it was when saved
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+};
+
+struct editJournal
+{
+    int fd;            // -1 while not journaling
+    char *path;
+    char *buf;         // Records not yet written
+    size_t len, cap;
+    long long sync_at; // When written records are due to be synced, 0 if none
+    bool replaying;    // Edits come from the journal, so are not recorded again
+};
+
+// Undo history. Each row edit is recorded with what it takes to reverse
+// it, and the edits made by one key form a group that is undone as a
+// step. Row texts go in row lists: for each row its length as a uint32_t,
+// then its bytes. Payloads live in a chunked arena that is appended to at
+// the end, cut back there when redo history is dropped, and freed from
+// the front as the oldest groups go to stay under EDILITE_UNDO_MAX.
+enum undoType
+{
+    UNDO_INSERT = 1,  // Bytes inserted into a row at a column
+    UNDO_DELETE,      // Bytes deleted from a row at a column
+    UNDO_INSERT_ROWS, // Rows inserted, as a row list
+    UNDO_DELETE_ROWS  // Rows deleted, as a row list
+};
+
+struct undoOp
+{
+    unsigned char type;
+    int row;
+    int arg;    // Column, or the number of rows
+    size_t pos; // Arena position of the payload
+    size_t len;
+};
+
+struct undoGroup
+{
+    size_t first;  // Index of the group's first op
+    int cy, cx;    // Cursor before the group
+    int ecy, ecx;  // Cursor after it
+};
+
+struct undoChunk
+{
+    char *data;
+    size_t pos; // Arena position of data[0]
+    size_t len, cap;
+};
+
+struct undoLog
+{
+    std::deque<undoOp> ops;
+    size_t opbase;             // Index of ops.front()
+    std::deque<undoGroup> groups;
+    size_t done;               // Groups applied; the ones after them can be redone
+    std::deque<undoChunk> arena;
+    size_t arenabytes;
+    bool open;     // The last group still takes the ops of the current key
+    bool typing;   // The current key types a character
+    bool extend;   // The open group is from the keys typed before this one
+    int cy, cx;    // Cursor before the current key
+    bool lost;     // The current key's edits outgrew the history and are not kept
+    bool applying; // Edits come from undo or redo, so are not recorded
+};
+
+// Bytes read from the terminal and not yet decoded into keys
+struct inputBuf
+{
+    char data[4096];
+    int len;
+    int pos; // Next byte to decode
+};
+
+// A headless replay for --bench: keys come from a script instead of the
+// terminal, frames go to /dev/null, and each frame's cost is kept
+struct benchRun
+{
+    const char *name;
+    char *script; // Bytes as the terminal would send them
+    size_t len;
+    size_t pos;   // Next byte to hand over
+    int rows;     // Fixed screen size
+    int cols;
+    int out;      // The real stdout, for the report
+    long keys;
+    unsigned long long bytes;      // Written to the terminal
+    std::vector<long long> frames; // Nanoseconds of each refresh
+    std::vector<long long> paints; // Nanoseconds from a key being read to the frame showing it
+    long long keyat;               // When the first key since the last frame was read, 0 if none
+    long long open;                // Nanoseconds editorOpen took
+    long long start;               // When the replay began
 };
 
 struct editorConfig
@@ -46,15 +474,255 @@ struct editorConfig
     int screencols;              // Number of columns on the screen
     int numrows;                 // Number of rows in the file
     int dirty;                   // Indicates if file has unsaved changes
-    erow *row;                   // Rows of text in the editor
+    rowNode *rows;               // Root of the row tree
     char *filename;              // Opened filename
     char statusmsg[80];          // Status message displayed to the user
     time_t statusmsg_time;       // Timestamp of the last status message
+    int prompting;               // A prompt is up; its message does not expire
     struct editorSyntax *syntax; // Syntax highlighting for the file type
     struct termios orig_termios; // Original terminal attributes
+    const char *map;             // Memory-mapped file contents, rows are loaded lazily
+    size_t mapsize;              // Size of the mapping in bytes
+    size_t *lineoff;             // Start offset of each mapped line, plus the end offset
+    erow *gaprow;                // Row whose chars may have an open gap
+    int loaded;                  // Loaded rows with a mapped line they may still match
+    int loadedkept;              // Of those, the ones the last unloading left loaded
+    size_t maplines;             // Number of lines in the mapping
+    std::atomic<unsigned char> *hlblock; // Comment state transfer of each block of mapped lines
+    hlWorker *hlworker;          // Background highlighting, while a mapped file has syntax
+    triIndex *trigrams;          // Search index of a large mapped file
+    kwTable keywords;            // Keywords of the syntax, hashed
+    bool hlscan;                 // Comment state can be followed with editorSyntaxLineState
+    bool hlopen[256];            // Bytes that may open a comment, string or header name
+    findIndex find;              // Matches of the last search
+    int matchrow;                // Row of the match drawn highlighted, -1 if none
+    int matchrx, matchend;       // Its render columns
+    inputBuf input;              // Keys typed or pasted ahead
+    int sigfd;                   // Readable when SIGWINCH arrived
+    int timerfd;                 // Readable when the next deadline passed, -1 without one
+    long long resize_at;         // When to redraw for a resize, 0 if none is waiting
+    editJournal journal;         // Swap file of the edits since the last save
+    undoLog undo;                // Edits that can be undone and redone
+    slabHeap slab;               // Memory for row text, render and tabs
+    scrCell *frame;              // Screen being drawn, rows of screencols cells
+    scrCell *shown;              // Screen as last written to the terminal
+    int framerows, framecols;    // Size of both
+    int shownrowoff;             // rowoff when `shown` was written
+    styleEsc styles[SCR_REVERSE]; // Colour escape of each cell style
+    std::string out;             // Bytes of the frame being flushed, kept between frames
+    int gutter;                  // Width of the line numbers, as of `gutterrows` rows
+    int gutterrows;
+#ifdef EDILITE_PROFILE
+    unsigned long frameallocs;   // Heap allocations made by the last refresh
+#endif
+    benchRun *bench;             // Replaying a key script, or null
 };
 struct editorConfig E;
 
+/*** clock ***/
+// Milliseconds on a clock that only moves forward
+long long editorNowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// The same clock in nanoseconds, for slicing work and timing it
+long long editorNowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*** allocation counting ***/
+// In a profiling build every operator new is counted, so a refresh can
+// tell whether it touched the heap. Other builds keep the standard allocator.
+#ifdef EDILITE_PROFILE
+std::atomic<unsigned long> editorHeapAllocs(0);
+
+void *operator new(size_t size)
+{
+    editorHeapAllocs.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+#endif
+
+/*** latency probes ***/
+// Built with -DEDILITE_PROFILE, the hot paths time themselves into
+// histograms that Ctrl-P shows over the text and that are written to
+// EDILITE_PROBE_FILE on exit. Without it EDILITE_PROBE is empty and none of
+// this is compiled in.
+#ifdef EDILITE_PROFILE
+enum editorProbeId
+{
+    PROBE_KEY, // From a key arriving to its frame being written
+    PROBE_SYNTAX,
+    PROBE_DRAW,
+    PROBE_WRITE,
+    PROBE_OPEN,
+    PROBE_SAVE,
+    PROBE_FIND,
+    PROBES
+};
+
+// Nanoseconds in log-linear buckets, as in HdrHistogram: values below
+// 2 << EDILITE_PROBE_BITS each get one, and every power of two above is
+// split into 1 << EDILITE_PROBE_BITS, so a bucket is within 1/16 of its value
+struct probeHist
+{
+    const char *name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[EDILITE_PROBE_BUCKETS];
+};
+
+probeHist editorProbes[PROBES] = {
+    {"key-paint", 0, 0, 0, {0}},
+    {"syntax", 0, 0, 0, {0}},
+    {"draw-rows", 0, 0, 0, {0}},
+    {"write", 0, 0, 0, {0}},
+    {"open", 0, 0, 0, {0}},
+    {"save", 0, 0, 0, {0}},
+    {"find", 0, 0, 0, {0}},
+};
+uint64_t editorProbeKeyAt; // When the first key not yet painted arrived, or 0
+bool editorProbeShown;     // Ctrl-P overlay is up
+
+int editorProbeBucket(uint64_t v)
+{
+    if (v < (2u << EDILITE_PROBE_BITS))
+        return v;
+    int p = 63 - __builtin_clzll(v);
+    int m = v >> (p - EDILITE_PROBE_BITS); // Top bits, from 1 << BITS up
+    return ((p - EDILITE_PROBE_BITS + 1) << EDILITE_PROBE_BITS) + m - (1 << EDILITE_PROBE_BITS);
+}
+
+// Largest value that falls in bucket `b`
+uint64_t editorProbeBucketTop(int b)
+{
+    if (b < (2 << EDILITE_PROBE_BITS))
+        return b;
+    int p = (b >> EDILITE_PROBE_BITS) + EDILITE_PROBE_BITS - 1;
+    uint64_t m = (b & ((1 << EDILITE_PROBE_BITS) - 1)) + (1 << EDILITE_PROBE_BITS);
+    return ((m + 1) << (p - EDILITE_PROBE_BITS)) - 1;
+}
+
+void editorProbeRecord(int id, uint64_t ns)
+{
+    probeHist *h = &editorProbes[id];
+    h->count++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->bucket[editorProbeBucket(ns)]++;
+}
+
+// The value at or below which fraction `q` of the samples fall
+uint64_t editorProbePercentile(const probeHist *h, double q)
+{
+    uint64_t want = (uint64_t)(q * h->count + 0.5);
+    if (want < 1)
+        want = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < EDILITE_PROBE_BUCKETS; b++)
+    {
+        seen += h->bucket[b];
+        if (seen >= want)
+        {
+            uint64_t top = editorProbeBucketTop(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+// `ns` in a few characters: 850ns, 12.3us, 4.56ms, 1.20s
+void editorProbeFormat(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000)
+        snprintf(buf, size, "%uns", (unsigned)ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+// One line of the summary of probe `id`, without a newline
+int editorProbeLine(char *buf, size_t size, int id)
+{
+    const probeHist *h = &editorProbes[id];
+    char p50[16], p90[16], p99[16], max[16];
+    editorProbeFormat(p50, sizeof(p50), editorProbePercentile(h, 0.50));
+    editorProbeFormat(p90, sizeof(p90), editorProbePercentile(h, 0.90));
+    editorProbeFormat(p99, sizeof(p99), editorProbePercentile(h, 0.99));
+    editorProbeFormat(max, sizeof(max), h->max);
+    return snprintf(buf, size, "%-10s %8lu %8s %8s %8s %8s", h->name, (unsigned long)h->count, p50, p90, p99, max);
+}
+
+// Write every probe that fired to EDILITE_PROBE_FILE: the summary, then
+// the percentile distribution bucket by bucket
+void editorProbeDump()
+{
+    FILE *fp = fopen(EDILITE_PROBE_FILE, "w");
+    if (!fp)
+        return;
+    char line[96];
+    fprintf(fp, "%-10s %8s %8s %8s %8s %8s\n", "probe", "count", "p50", "p90", "p99", "max");
+    for (int id = 0; id < PROBES; id++)
+    {
+        if (editorProbes[id].count)
+        {
+            editorProbeLine(line, sizeof(line), id);
+            fprintf(fp, "%s\n", line);
+        }
+    }
+    for (int id = 0; id < PROBES; id++)
+    {
+        const probeHist *h = &editorProbes[id];
+        if (!h->count)
+            continue;
+        fprintf(fp, "\n%s: %lu samples, mean %.0f ns\n%14s %12s %10s\n", h->name, (unsigned long)h->count,
+                (double)h->sum / h->count, "value (ns)", "percentile", "count");
+        uint64_t seen = 0;
+        for (int b = 0; b < EDILITE_PROBE_BUCKETS; b++)
+        {
+            if (!h->bucket[b])
+                continue;
+            seen += h->bucket[b];
+            uint64_t top = editorProbeBucketTop(b);
+            fprintf(fp, "%14lu %12.6f %10lu\n", (unsigned long)(top < h->max ? top : h->max),
+                    (double)seen / h->count, (unsigned long)h->bucket[b]);
+        }
+    }
+    fclose(fp);
+}
+
+// Times the scope it is declared in
+struct editorProbeScope
+{
+    int id;
+    uint64_t start;
+    explicit editorProbeScope(int id) : id(id), start((uint64_t)editorNowNs()) {}
+    ~editorProbeScope() { editorProbeRecord(id, (uint64_t)editorNowNs() - start); }
+};
+#define EDILITE_PROBE(id) editorProbeScope editorProbe_(id)
+#else
+#define EDILITE_PROBE(id)
+#endif
+
 enum editorKey
 {
     BACKSPACE = 127,
@@ -66,7 +734,9 @@ enum editorKey
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START, // Text after this was pasted, up to PASTE_END
+    PASTE_END
 };
 
 enum editorHighlight
@@ -113,7 +783,23 @@ struct editorSyntax HLDB[] = {
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorRowCloseGap(erow *row);
+void editorChunkSyntax(erow *row);
+void editorCompactSyntax(erow *row);
+void editorUpdateRow(erow *row);
+int editorBenchReadByte(char *c, int timeout);
+void editorBenchFrame(long long start, size_t bytes);
+void editorFindRowChanged(erow *row);
+void editorFindRowInserted(int at);
+void editorFindRowsInserted(int at, int count);
+void editorFindRowDeleted(int at);
+void editorFindRowsDeleted(int at, int count);
+bool editorFindPending();
+void editorFindIdle();
+void editorFindClear();
 std::string editorPrompt(const std::string &prompt, void (*callback)(const std::string &, int));
+void editorWaitInput();
+void editorJournalReset();
 
 /** Terminal */
 void die(const char *s)
@@ -128,6 +814,7 @@ void die(const char *s)
 
 void disableRawMode()
 {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -153,31 +840,99 @@ void enableRawMode()
     // Apply new settings
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+
+    // Have the terminal mark pasted text, so it goes in as one edit
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+// Next input byte. A pasted block or a burst of key repeats comes in with
+// one read(). With `timeout` set to milliseconds, gives up and returns 0 if
+// nothing arrives in that time; -1 waits for as long as it takes.
+int editorReadByte(char *c, int timeout)
+{
+    if (E.input.pos == E.input.len)
+    {
+        if (E.bench)
+            return editorBenchReadByte(c, timeout);
+        if (timeout >= 0)
+        {
+            struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&pfd, 1, timeout) <= 0)
+                return 0;
+        }
+        else
+        {
+            editorWaitInput();
+        }
+        int nread;
+        while ((nread = read(STDIN_FILENO, E.input.data, sizeof(E.input.data))) <= 0)
+        {
+            if (nread == -1 && errno != EAGAIN)
+                die("read");
+        }
+        E.input.len = nread;
+        E.input.pos = 0;
+    }
+    *c = E.input.data[E.input.pos++];
+    return 1;
+}
+
+// Whether a key is already waiting, so drawing the screen can wait
+bool editorInputPending()
+{
+    if (E.bench)
+        return false; // Every key of a replay gets its own frame
+    if (E.input.pos < E.input.len)
+        return true;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
 }
 
 int editorReadKey()
 {
-    int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    // A replay has no pauses between keys, so search indexing that would
+    // run in them is finished here
+    while (E.bench && editorFindPending())
+        editorFindIdle();
+    editorReadByte(&c, -1);
+    if (E.bench)
     {
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
+        E.bench->keys++;
+        if (!E.bench->keyat)
+            E.bench->keyat = editorNowNs();
     }
+    // Hold off background highlighting until the screen is drawn again
+    if (E.hlworker)
+        E.hlworker->busy = true;
+    if (E.trigrams)
+        E.trigrams->busy = true;
     if (c == '\x1b')
     {
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+        if (!editorReadByte(&seq[0], EDILITE_ESC_TIMEOUT))
             return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+        if (!editorReadByte(&seq[1], EDILITE_ESC_TIMEOUT))
             return '\x1b';
 
         if (seq[0] == '[')
         {
             if (seq[1] >= '0' && seq[1] <= '9')
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                if (!editorReadByte(&seq[2], EDILITE_ESC_TIMEOUT))
                     return '\x1b';
+                if (seq[1] == '2' && seq[2] == '0')
+                {
+                    // ESC [ 200 ~ and ESC [ 201 ~ enclose pasted text
+                    char end[2];
+                    if (!editorReadByte(&end[0], EDILITE_ESC_TIMEOUT) ||
+                        !editorReadByte(&end[1], EDILITE_ESC_TIMEOUT) || end[1] != '~')
+                        return '\x1b';
+                    if (end[0] == '0')
+                        return PASTE_START;
+                    if (end[0] == '1')
+                        return PASTE_END;
+                }
                 if (seq[2] == '~')
                 {
                     switch (seq[1])
@@ -237,6 +992,26 @@ int editorReadKey()
     }
 }
 
+// Text pasted after PASTE_START, read raw up to the closing ESC [ 201 ~.
+// If the terminal stops sending before the end marker, what arrived is
+// the paste and keys go back to being keys.
+std::string editorReadPaste()
+{
+    std::string text;
+    char c;
+    for (;;)
+    {
+        if (!editorReadByte(&c, EDILITE_PASTE_TIMEOUT))
+            return text;
+        text += c;
+        if (c == '~' && text.size() >= 6 && text.compare(text.size() - 6, 6, "\x1b[201~") == 0)
+        {
+            text.resize(text.size() - 6);
+            return text;
+        }
+    }
+}
+
 int getCursorPosition(int *rows, int *cols)
 {
     char buf[32];
@@ -288,81 +1063,565 @@ int getWindowSize(int *rows, int *cols)
     }
 }
 
-/*** syntax highlighting ***/
-const char *editorSyntaxToColor(int hl)
+/*** row memory ***/
+// Rows take their text, render and tab blocks from slabs instead of one
+// malloc each, and freed blocks go to the next row that needs that size
+
+// Size of the block that holds `n` bytes: a multiple of 16 up to
+// EDILITE_SLAB_STEPS, doubling from there
+size_t editorSlabSize(size_t n)
 {
-    switch (hl)
-    {
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-        return "\033[38;5;41m"; // Cyan Green
-    case HL_KEYWORD1:
-        return "\033[38;5;32m"; // Blue
-    case HL_KEYWORD2:
-        return "\033[38;5;12m"; // Blue
-    case HL_STRING:
-        return "\033[38;5;197m"; // Brown
-    case HL_NUMBER:
-        return "\033[38;5;45m"; // Cyan
-    case HL_MATCH:
-        return "\033[93m"; // Bright Yellow
-    case HL_INCLUDE:
-        return "\033[38;5;92m"; // Purple
-    case HL_HEADER:
-        return "\033[38;5;3m"; // Light Purple
-    case HL_DEFINE:
-        return "\033[38;5;92m"; // Purple
-    case HL_CAPS:
-        return "\033[38;5;13m"; // Bright Cyan
-    default:
-        return "\033[97m"; // White
-    }
+    if (n > EDILITE_SLAB_MAX)
+        return n;
+    if (n <= EDILITE_SLAB_STEPS)
+        return n <= EDILITE_SLAB_MIN ? EDILITE_SLAB_MIN : (n + EDILITE_SLAB_MIN - 1) & ~(size_t)(EDILITE_SLAB_MIN - 1);
+    size_t size = EDILITE_SLAB_STEPS;
+    while (size < n)
+        size <<= 1;
+    return size;
 }
 
-int is_separator(int c)
+int editorSlabClass(size_t size)
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    if (size <= EDILITE_SLAB_STEPS)
+        return size / EDILITE_SLAB_MIN - 1;
+    int c = EDILITE_SLAB_STEPS / EDILITE_SLAB_MIN - 1;
+    while ((size_t)EDILITE_SLAB_STEPS << (c - (EDILITE_SLAB_STEPS / EDILITE_SLAB_MIN - 1)) < size)
+        c++;
+    return c;
 }
 
-int is_separator_caps(int c)
+void editorSlabFree(void *p, size_t size)
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];}:?", c) != NULL;
+    if (!p)
+        return;
+    if (size > EDILITE_SLAB_MAX)
+    {
+        free(p);
+        return;
+    }
+    int c = editorSlabClass(size);
+    *(void **)p = E.slab.free[c];
+    E.slab.free[c] = p;
 }
 
-void editorUpdateSyntax(erow *row)
+// A block of `size` bytes, a size given by editorSlabSize
+void *editorSlabAlloc(size_t size)
 {
-    // Resize hl array to match the row's render size
-    row->hl = (unsigned char *)realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize); // Set all to normal initially
+    if (size > EDILITE_SLAB_MAX)
+        return malloc(size);
+    slabHeap *h = &E.slab;
+    int c = editorSlabClass(size);
+    if (h->free[c])
+    {
+        void *p = h->free[c];
+        h->free[c] = *(void **)p;
+        return p;
+    }
+    if (h->left < size)
+    {
+        // What is left of the old slab is handed out as smaller blocks
+        while (h->left >= EDILITE_SLAB_MIN)
+        {
+            size_t n = EDILITE_SLAB_MAX;
+            while (n > h->left && n > EDILITE_SLAB_STEPS)
+                n >>= 1;
+            if (n > h->left)
+                n = h->left;
+            editorSlabFree(h->next, n);
+            h->next += n;
+            h->left -= n;
+        }
+        h->next = (char *)malloc(EDILITE_SLAB);
+        h->left = EDILITE_SLAB;
+        h->bytes += EDILITE_SLAB;
+    }
+    void *p = h->next;
+    h->next += size;
+    h->left -= size;
+    return p;
+}
 
-    if (E.syntax == NULL)
-        return;
+// Move a block of `old` bytes to one of `size`, keeping what fits
+void *editorSlabRealloc(void *p, size_t old, size_t size)
+{
+    if (old == size)
+        return p;
+    if (old > EDILITE_SLAB_MAX && size > EDILITE_SLAB_MAX)
+        return realloc(p, size);
+    void *q = editorSlabAlloc(size);
+    if (p)
+        memcpy(q, p, old < size ? old : size);
+    editorSlabFree(p, old);
+    return q;
+}
 
-    char **keywords = E.syntax->keywords;
+/*** row storage ***/
+unsigned editorRandom()
+{
+    static unsigned x = 2463534242u; // xorshift32
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+rowNode *editorNewNode(int line, int lines)
+{
+    rowNode *n = (rowNode *)editorSlabAlloc(editorSlabSize(sizeof(rowNode)));
+    memset(n, 0, sizeof(rowNode));
+    n->prio = editorRandom();
+    n->lines = lines;
+    n->count = lines;
+    n->line = line;
+    n->mapped = -1;
+    return n;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+int editorNodeCount(rowNode *n)
+{
+    return n ? n->count : 0;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int i = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+void editorNodeUpdate(rowNode *n)
+{
+    n->count = editorNodeCount(n->left) + n->lines + editorNodeCount(n->right);
+    n->stale = n->row.hl_stale + (n->left ? n->left->stale : 0) +
+               (n->right ? n->right->stale : 0);
+    if (n->left)
+        n->left->parent = n;
+    if (n->right)
+        n->right->parent = n;
+}
 
-    while (i < row->rsize)
+rowNode *editorNodeMerge(rowNode *a, rowNode *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio > b->prio)
     {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        a->right = editorNodeMerge(a->right, b);
+        editorNodeUpdate(a);
+        return a;
+    }
+    b->left = editorNodeMerge(a, b->left);
+    editorNodeUpdate(b);
+    return b;
+}
 
-        if (scs_len && !in_string && !in_comment)
-        {
-            if (!strncmp(&row->render[i], scs, scs_len))
+// Split `t` so that `*l` gets its first `k` rows and `*r` the rest. An
+// unloaded run that straddles the split point is cut in two.
+void editorNodeSplit(rowNode *t, int k, rowNode **l, rowNode **r)
+{
+    if (!t)
+    {
+        *l = *r = nullptr;
+        return;
+    }
+
+    int left = editorNodeCount(t->left);
+    if (k <= left)
+    {
+        editorNodeSplit(t->left, k, l, &t->left);
+        editorNodeUpdate(t);
+        *r = t;
+    }
+    else if (k >= left + t->lines)
+    {
+        editorNodeSplit(t->right, k - left - t->lines, &t->right, r);
+        editorNodeUpdate(t);
+        *l = t;
+    }
+    else
+    {
+        int head = k - left;
+        rowNode *tail = editorNewNode(t->line + head, t->lines - head);
+        // The tail ends where the whole run did; where the head ends is unknown
+        tail->row.hl_open_comment = t->row.hl_open_comment;
+        tail->row.hl_stale = t->row.hl_stale;
+        editorNodeUpdate(tail);
+        t->row.hl_stale = 1;
+        t->lines = head;
+        *r = editorNodeMerge(tail, t->right);
+        t->right = nullptr;
+        editorNodeUpdate(t);
+        *l = t;
+    }
+}
+
+// Node holding row `at`; `k` receives the row's position inside the node
+rowNode *editorNodeFind(int at, int *k)
+{
+    rowNode *n = E.rows;
+    while (n)
+    {
+        int left = editorNodeCount(n->left);
+        if (at < left)
+        {
+            n = n->left;
+        }
+        else if (at < left + n->lines)
+        {
+            *k = at - left;
+            return n;
+        }
+        else
+        {
+            at -= left + n->lines;
+            n = n->right;
+        }
+    }
+    return nullptr;
+}
+
+// Row number of the first row in `n`, computed from the subtree sizes
+int editorNodeIndex(rowNode *n)
+{
+    int at = editorNodeCount(n->left);
+    for (; n->parent; n = n->parent)
+    {
+        if (n == n->parent->right)
+            at += editorNodeCount(n->parent->left) + n->parent->lines;
+    }
+    return at;
+}
+
+// Recompute the counts on the path from `n` to the root
+void editorNodeRefresh(rowNode *n)
+{
+    for (; n; n = n->parent)
+        editorNodeUpdate(n);
+}
+
+rowNode *editorNodeFirst()
+{
+    rowNode *n = E.rows;
+    while (n && n->left)
+        n = n->left;
+    return n;
+}
+
+rowNode *editorNodeNext(rowNode *n)
+{
+    if (n->right)
+    {
+        n = n->right;
+        while (n->left)
+            n = n->left;
+        return n;
+    }
+    while (n->parent && n == n->parent->right)
+        n = n->parent;
+    return n->parent;
+}
+
+rowNode *editorNodePrev(rowNode *n)
+{
+    if (n->left)
+    {
+        n = n->left;
+        while (n->right)
+            n = n->right;
+        return n;
+    }
+    while (n->parent && n == n->parent->left)
+        n = n->parent;
+    return n->parent;
+}
+
+// Put node `n` in front of row `at`
+void editorNodeInsert(int at, rowNode *n)
+{
+    rowNode *a, *b;
+    editorNodeUpdate(n); // Its row may have changed while it was out
+    editorNodeSplit(E.rows, at, &a, &b);
+    E.rows = editorNodeMerge(editorNodeMerge(a, n), b);
+    E.rows->parent = nullptr;
+}
+
+// Take row `at` out of the tree as a node of its own
+rowNode *editorNodeRemove(int at)
+{
+    rowNode *a, *b, *m, *c;
+    editorNodeSplit(E.rows, at, &a, &b);
+    editorNodeSplit(b, 1, &m, &c);
+    E.rows = editorNodeMerge(a, c);
+    if (E.rows)
+        E.rows->parent = nullptr;
+    m->parent = nullptr;
+    return m;
+}
+
+// Mapped line `line` without its line ending; `len` receives its size
+const char *editorMapLine(size_t line, int *len)
+{
+    const char *s = E.map + E.lineoff[line];
+    size_t end = E.lineoff[line + 1] - E.lineoff[line];
+    while (end > 0 && (s[end - 1] == '\n' || s[end - 1] == '\r'))
+        end--;
+    *len = end;
+    return s;
+}
+
+// Text of row `k` of node `n`, read from the mapping if it is not loaded
+const char *editorNodeText(rowNode *n, int k, int *len)
+{
+    if (n->line < 0)
+    {
+        if (&n->row == E.gaprow)
+            editorRowCloseGap(&n->row);
+        *len = n->row.size;
+        return n->row.chars;
+    }
+    return editorMapLine(n->line + k, len);
+}
+
+/*** syntax highlighting ***/
+const char *editorSyntaxToColor(int hl)
+{
+    switch (hl)
+    {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+        return "\033[38;5;41m"; // Cyan Green
+    case HL_KEYWORD1:
+        return "\033[38;5;32m"; // Blue
+    case HL_KEYWORD2:
+        return "\033[38;5;12m"; // Blue
+    case HL_STRING:
+        return "\033[38;5;197m"; // Brown
+    case HL_NUMBER:
+        return "\033[38;5;45m"; // Cyan
+    case HL_MATCH:
+        return "\033[93m"; // Bright Yellow
+    case HL_INCLUDE:
+        return "\033[38;5;92m"; // Purple
+    case HL_HEADER:
+        return "\033[38;5;3m"; // Light Purple
+    case HL_DEFINE:
+        return "\033[38;5;92m"; // Purple
+    case HL_CAPS:
+        return "\033[38;5;13m"; // Bright Cyan
+    default:
+        return "\033[97m"; // White
+    }
+}
+
+constexpr bool editorCharIn(const char *set, int c)
+{
+    return *set && (*set == c || editorCharIn(set + 1, c));
+}
+
+constexpr unsigned char editorClassOf(int c)
+{
+    return ((c == ' ' || (c >= '\t' && c <= '\r') || c == '\0' || editorCharIn(",.()+-/*=~%<>[];", c))
+                ? CC_SEP | CC_SEP_CAPS
+                : editorCharIn("}:?", c) ? CC_SEP_CAPS
+                                         : 0) |
+           (c >= '0' && c <= '9' ? CC_DIGIT : 0) | (c >= 'A' && c <= 'Z' ? CC_UPPER : 0);
+}
+
+// Class bits of every byte, worked out at compile time
+#define CC4(c) editorClassOf(c), editorClassOf(c + 1), editorClassOf(c + 2), editorClassOf(c + 3)
+#define CC16(c) CC4(c), CC4(c + 4), CC4(c + 8), CC4(c + 12)
+#define CC64(c) CC16(c), CC16(c + 16), CC16(c + 32), CC16(c + 48)
+const unsigned char editorCharClass[256] = {CC64(0), CC64(64), CC64(128), CC64(192)};
+
+int is_separator(int c)
+{
+    return editorCharClass[(unsigned char)c] & CC_SEP;
+}
+
+int is_separator_caps(int c)
+{
+    return editorCharClass[(unsigned char)c] & CC_SEP_CAPS;
+}
+
+unsigned editorKeywordHash(const char *s, int len, unsigned seed)
+{
+    unsigned h = seed ^ 2166136261u;
+    for (int j = 0; j < len; j++)
+        h = (h ^ (unsigned char)s[j]) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+// Hash the keywords of the current syntax, trying seeds until every
+// keyword lands in a slot of its own. This runs once at startup, when the
+// syntax is selected, rather than at compile time: HLDB keeps its keywords
+// in plain char * arrays, which a C++11 constexpr function cannot walk, and
+// the search takes microseconds for a syntax's few dozen keywords.
+void editorBuildKeywords()
+{
+    kwTable *t = &E.keywords;
+    free(t->slots);
+    t->slots = nullptr;
+    t->mask = 0;
+    t->maxlen = 0;
+    if (E.syntax == NULL || E.syntax->keywords == NULL)
+        return;
+
+    char **keywords = E.syntax->keywords;
+    int n = 0;
+    while (keywords[n])
+        n++;
+    unsigned size = 4;
+    while (size < 2 * (unsigned)n)
+        size *= 2;
+
+    for (unsigned seed = 0;; seed++)
+    {
+        // Grow the table if no seed has worked for a while
+        if (seed > 0 && seed % 1024 == 0)
+            size *= 2;
+        t->slots = (kwSlot *)realloc(t->slots, sizeof(kwSlot) * size);
+        memset(t->slots, 0, sizeof(kwSlot) * size);
+        int j;
+        for (j = 0; j < n; j++)
+        {
+            int len = strlen(keywords[j]);
+            int kw2 = keywords[j][len - 1] == '|';
+            if (kw2)
+                len--;
+            kwSlot *slot = &t->slots[editorKeywordHash(keywords[j], len, seed) & (size - 1)];
+            if (slot->word)
+                break;
+            slot->word = keywords[j];
+            slot->len = len;
+            slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+            if (len > t->maxlen)
+                t->maxlen = len;
+        }
+        if (j == n)
+        {
+            t->mask = size - 1;
+            t->seed = seed;
+            return;
+        }
+        t->maxlen = 0;
+    }
+}
+
+// Keyword spelled by the `len` bytes at `s`, or null
+const kwSlot *editorKeywordFind(const char *s, int len)
+{
+    const kwTable *t = &E.keywords;
+    if (!t->slots || len > t->maxlen)
+        return nullptr;
+    const kwSlot *slot = &t->slots[editorKeywordHash(s, len, t->seed) & t->mask];
+    if (slot->word && slot->len == len && !memcmp(slot->word, s, len))
+        return slot;
+    return nullptr;
+}
+
+// Highlight `len` bytes of `text` into `hl` starting from lexer state `st`,
+// which is left where the run stopped. With a null `hl` only the state is
+// followed, which is how comment state is carried over unloaded lines. With
+// `cprow` set a state is saved into it every EDILITE_HL_CHECKPOINT columns.
+// When `old` is given, the run stops as soon as it meets one of those states
+// again at or after column `from` and returns its index, since everything
+// after it is unchanged; otherwise the run goes to the end and returns -1.
+int editorHighlightRun(const char *text, int len, unsigned char *hl, hlState *st,
+                       erow *cprow, const hlState *old, int nold, int from, const hlWindow *win)
+{
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    // Columns past `i` a single step may read, apart from keywords, headers and caps
+    int look = 8;
+    if (scs_len > look)
+        look = scs_len;
+    if (mcs_len > look)
+        look = mcs_len;
+    if (mce_len > look)
+        look = mce_len;
+
+    int base = win ? win->base : 0; // Row column of text[0]
+    int prev_sep = st->prev_sep;
+    int in_string = st->in_string;
+    int in_comment = st->in_comment;
+    int reach = st->reach;
+    int i = st->i;
+    int next_cp = (cprow && cprow->hl_ncp ? cprow->hl_cp[cprow->hl_ncp - 1].i : 0) + EDILITE_HL_CHECKPOINT;
+    int m = 0;
+    int found = -1;
+
+    // hl is reset just ahead of the first write to it, so a run that starts
+    // mid-row never sees stale attributes. The last write is remembered to
+    // know the previous column's highlight without reading hl.
+    int cleared = i;
+    int last_end = i;
+    unsigned char last_hl = st->prev_hl;
+    auto clear = [&](int to)
+    {
+        if (to > len)
+            to = len;
+        if (hl && to > cleared)
+            memset(&hl[cleared], HL_NORMAL, to - cleared);
+        if (to > cleared)
+            cleared = to;
+    };
+    auto mark = [&](int at, int n, unsigned char v)
+    {
+        clear(at + n);
+        if (hl)
+            memset(&hl[at], v, n);
+        last_end = at + n;
+        last_hl = v;
+    };
+
+    while (i < len)
+    {
+        clear(i);
+        char c = text[i];
+        unsigned char prev_hl = (i + base > 0 && last_end == i) ? last_hl : (unsigned char)HL_NORMAL;
+
+        if (old && i >= from)
+        {
+            while (m < nold && old[m].i < i)
+                m++;
+            if (m < nold && old[m].i == i && old[m].prev_sep == prev_sep &&
+                old[m].in_string == in_string && old[m].in_comment == in_comment &&
+                old[m].prev_hl == prev_hl)
+            {
+                found = m;
+                break;
+            }
+        }
+        if (win)
+        {
+            if (i <= win->stop)
+                *win->next = {i, reach, (char)prev_sep, (char)in_string, (char)in_comment, prev_hl};
+            if (i >= win->stop)
+                break;
+        }
+        if (cprow && i >= next_cp)
+        {
+            if (cprow->hl_ncp % 16 == 0)
+                cprow->hl_cp = (hlState *)realloc(cprow->hl_cp, sizeof(hlState) * (cprow->hl_ncp + 16));
+            hlState cp = {i, reach, (char)prev_sep, (char)in_string, (char)in_comment, prev_hl};
+            cprow->hl_cp[cprow->hl_ncp++] = cp;
+            next_cp = i + EDILITE_HL_CHECKPOINT;
+        }
+        if (i + look > reach)
+            reach = i + look;
+
+        if (scs_len && !in_string && (in_comment == 2 || !in_comment))
+        {
+            if (in_comment == 2 || !strncmp(&text[i], scs, scs_len))
             {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                mark(i, len - i, HL_COMMENT);
+                i = len;
+                in_comment = 0;
+                // A window ending inside the comment hands it on to the next one
+                if (win && win->stop < len)
+                    *win->next = {win->stop, reach, 1, 0, 2, HL_COMMENT};
                 break;
             }
         }
@@ -371,10 +1630,10 @@ void editorUpdateSyntax(erow *row)
         {
             if (in_comment)
             {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len))
+                mark(i, 1, HL_MLCOMMENT);
+                if (!strncmp(&text[i], mce, mce_len))
                 {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                    mark(i, mce_len, HL_MLCOMMENT);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -386,9 +1645,9 @@ void editorUpdateSyntax(erow *row)
                     continue;
                 }
             }
-            else if (!strncmp(&row->render[i], mcs, mcs_len))
+            else if (!strncmp(&text[i], mcs, mcs_len))
             {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+                mark(i, mcs_len, HL_MLCOMMENT);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
@@ -396,40 +1655,44 @@ void editorUpdateSyntax(erow *row)
         }
 
         // Highlight #include and #define
-        if (i == 0 && (strncmp(&row->render[i], "#include", 8) == 0 || strncmp(&row->render[i], "#define", 7) == 0))
+        if (i + base == 0 && (strncmp(&text[i], "#include", 8) == 0 || strncmp(&text[i], "#define", 7) == 0))
         {
-            int len = (row->render[i] == '#') ? (row->render[i + 1] == 'i' ? 8 : 7) : 0;
-            memset(&row->hl[i], (len == 8) ? HL_INCLUDE : HL_DEFINE, len);
-            i += len;
+            int n = (text[i] == '#') ? (text[i + 1] == 'i' ? 8 : 7) : 0;
+            mark(i, n, (n == 8) ? HL_INCLUDE : HL_DEFINE);
+            i += n;
             prev_sep = 1;
             continue;
         }
 
         // Highlight header files names, like <stdio.h>
-        if (!in_string && !in_comment && row->render[i] == '<')
+        if (!in_string && !in_comment && text[i] == '<')
         {
             int j = i + 1;
-            while (j < row->rsize && row->render[j] != '>')
+            while (j < len && text[j] != '>')
                 j++;
-            if (j < row->rsize)
+            if (j > reach)
+                reach = j;
+            if (j < len)
             {
-                memset(&row->hl[i], HL_HEADER, j - i + 1);
+                mark(i, j - i + 1, HL_HEADER);
                 i = j + 1;
                 prev_sep = 1;
                 continue;
             }
         }
 
-        if (E.syntax->flags && !in_string && !in_comment && (prev_sep && isupper(c)))
+        if (E.syntax->flags && !in_string && !in_comment && (prev_sep && (editorCharClass[(unsigned char)c] & CC_UPPER)))
         {
             int start = i;
-            while (i < row->rsize && (isupper(row->render[i]) || row->render[i] == '_' || isdigit(row->render[i])))
+            while (i < len && ((editorCharClass[(unsigned char)text[i]] & (CC_UPPER | CC_DIGIT)) || text[i] == '_'))
             {
                 i++;
             }
-            if (is_separator_caps(row->render[i]))
+            if (i > reach)
+                reach = i;
+            if (is_separator_caps(text[i]))
             {
-                memset(&row->hl[start], HL_CAPS, i - start); // Apply `HL_CAPS` color
+                mark(start, i - start, HL_CAPS); // Apply `HL_CAPS` color
             }
             i--;
         }
@@ -438,10 +1701,10 @@ void editorUpdateSyntax(erow *row)
         {
             if (in_string)
             {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize)
+                mark(i, 1, HL_STRING);
+                if (c == '\\' && i + 1 < len)
                 {
-                    row->hl[i + 1] = HL_STRING;
+                    mark(i + 1, 1, HL_STRING);
                     i += 2;
                     continue;
                 }
@@ -456,7 +1719,7 @@ void editorUpdateSyntax(erow *row)
                 if (c == '"' || c == '\'')
                 {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    mark(i, 1, HL_STRING);
                     i++;
                     continue;
                 }
@@ -464,35 +1727,32 @@ void editorUpdateSyntax(erow *row)
         }
         if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
         {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+            if (((editorCharClass[(unsigned char)c] & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
                 (c == '.' && prev_hl == HL_NUMBER))
             {
-                row->hl[i] = HL_NUMBER;
+                mark(i, 1, HL_NUMBER);
                 i++;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        if (prev_sep)
+        // Keywords are only letters and cannot change the comment state
+        if (prev_sep && hl)
         {
-            int j;
-            for (j = 0; keywords[j]; j++)
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                    klen--;
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen]))
-                {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL)
+            // Only the word up to the next separator can match, and only if
+            // it is no longer than the longest keyword
+            int maxlen = E.keywords.maxlen;
+            int klen = 0;
+            while (klen <= maxlen && i + klen < len && !(editorCharClass[(unsigned char)text[i + klen]] & CC_SEP))
+                klen++;
+            if (i + maxlen > reach)
+                reach = i + maxlen;
+            const kwSlot *kw = editorKeywordFind(&text[i], klen);
+            if (kw)
             {
+                mark(i, klen, kw->hl);
+                i += klen;
                 prev_sep = 0;
                 continue;
             }
@@ -502,406 +1762,4119 @@ void editorUpdateSyntax(erow *row)
         prev_sep = is_separator(c);
         i++;
     }
+    clear(i);
+
+    st->i = i;
+    st->prev_hl = (i + base > 0 && last_end == i) ? last_hl : (unsigned char)HL_NORMAL;
+    st->reach = reach;
+    st->prev_sep = prev_sep;
+    st->in_string = in_string;
+    st->in_comment = in_comment;
+    return found;
+}
+
+void editorSyntaxSetStale(erow *row, int stale)
+{
+    if (row->hl_stale != stale)
+    {
+        row->hl_stale = stale;
+        editorNodeRefresh((rowNode *)row);
+    }
+}
 
+// Store the comment state left open at the end of the row, or at the end of
+// an unloaded run. A change only marks the next node stale; stale nodes are
+// brought up to date when rows under them are about to be drawn, so the
+// change travels down no further than needed.
+void editorSyntaxSetOpenComment(erow *row, int in_comment)
+{
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    rowNode *next = editorNodeNext((rowNode *)row);
+    if (changed && next)
+        editorSyntaxSetStale(&next->row, 1);
 }
 
-void editorSelectSyntaxHighlight()
+// Comment state entering node `n`
+int editorSyntaxEntry(rowNode *n)
 {
-    E.syntax = NULL;
-    if (E.filename == NULL)
-        return;
-    char *ext = strrchr(E.filename, '.');
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    rowNode *prev = editorNodePrev(n);
+    return prev && prev->row.hl_open_comment == 1;
+}
+
+// Set up editorSyntaxLineState for the syntax. It checks every byte for a
+// comment start, where the lexer steps over runs of capitals and digits,
+// so it is only used when no comment starts with one.
+void editorSyntaxInitScan()
+{
+    const char *delims[3] = {E.syntax->singleline_comment_start, E.syntax->multiline_comment_start,
+                             E.syntax->multiline_comment_end};
+    memset(E.hlopen, 0, sizeof(E.hlopen));
+    E.hlscan = true;
+    for (int j = 0; j < 3; j++)
     {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i])
+        unsigned char c = delims[j] ? delims[j][0] : 0;
+        if (c && ((editorCharClass[c] & (CC_UPPER | CC_DIGIT)) || c == '_'))
+            E.hlscan = false;
+        if (c && j < 2)
+            E.hlopen[c] = true;
+    }
+    E.hlopen[(unsigned char)'<'] = true;
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
+        E.hlopen[(unsigned char)'"'] = E.hlopen[(unsigned char)'\''] = true;
+}
+
+// Comment state after line `s` entered with `in_comment`, as
+// editorHighlightRun would leave it, for much less work: only comments,
+// strings and header names can change it, so the bytes between them are
+// skipped over and comment and string bodies are searched for their end.
+int editorSyntaxLineState(const char *s, int len, int in_comment)
+{
+    const char *scs = E.syntax->singleline_comment_start;
+    const char *mcs = E.syntax->multiline_comment_start;
+    const char *mce = E.syntax->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+    if (in_comment && (!mcs_len || !mce_len))
+        return in_comment;
+    char in_string = 0;
+    int i = 0;
+    while (i < len)
+    {
+        if (in_comment)
         {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i])))
+            const char *end = (const char *)memmem(s + i, len - i, mce, mce_len);
+            if (!end)
+                return 1;
+            i = end - s + mce_len;
+            in_comment = 0;
+        }
+        else if (in_string)
+        {
+            if (s[i] == '\\' && i + 1 < len)
+                i++;
+            else if (s[i] == in_string)
+                in_string = 0;
+            i++;
+        }
+        else
+        {
+            while (i < len && !E.hlopen[(unsigned char)s[i]])
+                i++;
+            if (i == len)
+                break;
+            if (scs_len && i + scs_len <= len && !memcmp(s + i, scs, scs_len))
+                return 0;
+            if (mcs_len && mce_len && i + mcs_len <= len && !memcmp(s + i, mcs, mcs_len))
             {
-                E.syntax = s;
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++)
-                {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
-                return;
+                i += mcs_len;
+                in_comment = 1;
+                continue;
             }
+            if (s[i] == '<')
+            {
+                const char *close = (const char *)memchr(s + i + 1, '>', len - i - 1);
+                i = close ? close - s + 1 : i + 1;
+                continue;
+            }
+            if ((s[i] == '"' || s[i] == '\'') && (E.syntax->flags & HL_HIGHLIGHT_STRINGS))
+                in_string = s[i];
             i++;
         }
     }
+    return in_comment;
 }
 
-/*** row operations ***/
-int editorRowCxToRx(erow *row, int cx)
+// Comment state after mapped lines [from, to) when entered with `in_comment`
+int editorSyntaxLinesState(size_t from, size_t to, int in_comment)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++)
+    for (size_t line = from; line < to; line++)
     {
-        if (row->chars[j] == '\t')
-            rx += (EDILITE_TAB_STOP - 1) - (rx % EDILITE_TAB_STOP);
-        rx++;
+        int len;
+        const char *s = editorMapLine(line, &len);
+        if (E.hlscan)
+        {
+            in_comment = editorSyntaxLineState(s, len, in_comment);
+            continue;
+        }
+        hlState st = {0, 0, 1, 0, (char)in_comment, HL_NORMAL};
+        editorHighlightRun(s, len, nullptr, &st, nullptr, nullptr, 0, 0, nullptr);
+        in_comment = st.in_comment;
     }
-    return rx;
+    return in_comment;
 }
 
-int editorRowRxToCx(erow *row, int rx)
+// Same, but whole blocks of EDILITE_HL_BLOCK lines go through their cached
+// transfer: for each state entering the block, a known bit and the state it
+// leaves. The mapped text never changes, so a block is lexed at most once
+// per entering state.
+int editorSyntaxMapState(size_t from, size_t to, int in_comment)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++)
+    while (from < to)
     {
-        if (row->chars[cx] == '\t')
-            cur_rx += (EDILITE_TAB_STOP - 1) - (cur_rx % EDILITE_TAB_STOP);
-        cur_rx++;
-        if (cur_rx > rx)
-            return cx;
+        size_t b = from / EDILITE_HL_BLOCK;
+        if (E.hlblock && from % EDILITE_HL_BLOCK == 0 && from + EDILITE_HL_BLOCK <= to)
+        {
+            int shift = 2 * in_comment;
+            unsigned char known = E.hlblock[b].load(std::memory_order_relaxed);
+            if (!(known >> shift & 1))
+            {
+                // The background thread may be on the same block; both
+                // arrive at the same bits
+                int out = editorSyntaxLinesState(from, from + EDILITE_HL_BLOCK, in_comment);
+                known = E.hlblock[b].fetch_or((1 | out << 1) << shift, std::memory_order_relaxed) | (1 | out << 1) << shift;
+            }
+            in_comment = known >> (shift + 1) & 1;
+            from += EDILITE_HL_BLOCK;
+        }
+        else
+        {
+            in_comment = editorSyntaxLinesState(from, from + 1, in_comment);
+            from++;
+        }
     }
-    return cx;
+    return in_comment;
 }
 
-void editorUpdateRow(erow *row)
+// Comment state leaving block `b` when entered with `in_comment`, working it
+// out on the background thread if not known yet; -1 if told to stop first
+int editorHighlighterBlock(hlWorker *w, size_t b, int in_comment)
 {
-    free(row->render);
+    int shift = 2 * in_comment;
+    unsigned char known = E.hlblock[b].load(std::memory_order_relaxed);
+    if (known >> shift & 1)
+        return known >> (shift + 1) & 1;
 
-    // For each tab, we may need up to 8 spaces, so allocate accordingly
-    int tabs = 0;
-    for (int j = 0; j < row->size; j++)
+    int out = in_comment;
+    for (size_t line = b * EDILITE_HL_BLOCK; line < (b + 1) * EDILITE_HL_BLOCK; line++)
     {
-        if (row->chars[j] == '\t')
-            tabs++;
+        // Keys come first: wait between lines until the editor is idle again
+        while (w->busy.load(std::memory_order_relaxed) && !w->stop.load(std::memory_order_relaxed))
+            usleep(1000);
+        if (w->stop.load(std::memory_order_relaxed))
+            return -1;
+        out = editorSyntaxLinesState(line, line + 1, out);
     }
+    E.hlblock[b].fetch_or((1 | out << 1) << shift, std::memory_order_relaxed);
+    return out;
+}
 
-    row->render = (char *)malloc(row->size + tabs * (EDILITE_TAB_STOP - 1) + 1);
-    int idx = 0;
-
-    for (int j = 0; j < row->size; j++)
+// Walk the blocks following the comment state of the file as it is on disk,
+// which is what unedited rows ask for, then fill in the other entering state
+// for when an edit above flips it
+void editorHighlighterMain(hlWorker *w)
+{
+    size_t nblocks = E.maplines / EDILITE_HL_BLOCK;
+    for (int pass = 0; pass < 2; pass++)
     {
-        if (row->chars[j] == '\t')
-        {
-            row->render[idx++] = ' ';
-            while (idx % (EDILITE_TAB_STOP) != 0)
-                row->render[idx++] = ' ';
-        }
-        else
+        int in_comment = 0;
+        for (size_t b = 0; b < nblocks; b++)
         {
-            row->render[idx++] = row->chars[j];
+            if (pass == 1 && editorHighlighterBlock(w, b, !in_comment) < 0)
+                return;
+            in_comment = editorHighlighterBlock(w, b, in_comment);
+            if (in_comment < 0)
+                return;
         }
     }
+}
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+void editorStartHighlighter()
+{
+    if (E.hlworker || !E.map || !E.hlblock || !E.syntax)
+        return;
+    E.hlworker = new hlWorker();
+    E.hlworker->stop = false;
+    E.hlworker->busy = false;
+    E.hlworker->thread = std::thread(editorHighlighterMain, E.hlworker);
+}
 
-    editorUpdateSyntax(row);
+// Needed before the mapping or the syntax changes. The thread checks for
+// this between lines, so this waits for at most one line to be lexed.
+void editorStopHighlighter()
+{
+    if (!E.hlworker)
+        return;
+    E.hlworker->stop = true;
+    E.hlworker->thread.join();
+    delete E.hlworker;
+    E.hlworker = nullptr;
 }
 
-void editorRowInsertChar(erow *row, int at, char c)
+// Index of the first row of the first stale node, or -1
+int editorSyntaxFirstStale()
 {
-    // Ensure 'at' is within bounds
-    if (at < 0 || at > row->size)
-        at = row->size;
+    rowNode *n = E.rows;
+    if (!n || !n->stale)
+        return -1;
+    int at = 0;
+    for (;;)
+    {
+        if (n->left && n->left->stale)
+            n = n->left;
+        else if (n->row.hl_stale)
+            return at + editorNodeCount(n->left);
+        else
+        {
+            at += editorNodeCount(n->left) + n->lines;
+            n = n->right;
+        }
+    }
+}
 
-    row->chars = (char *)realloc(row->chars, row->size + 2); // Adjust size for new char + null byte
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at);
-    row->chars[at] = c;
-    row->size++;
+void editorUpdateSyntax(erow *row)
+{
+    EDILITE_PROBE(PROBE_SYNTAX);
+    if (row->chunks)
+    {
+        editorSyntaxSetStale(row, 0);
+        editorChunkSyntax(row);
+        return;
+    }
+    if (row->compact)
+    {
+        editorSyntaxSetStale(row, 0);
+        editorCompactSyntax(row);
+        return;
+    }
+    memset(row->hl, HL_NORMAL, row->rsize); // Set all to normal initially
+    row->hl_ncp = 0;
+    editorSyntaxSetStale(row, 0);
 
-    // Update render vector and rsize accordingly
-    editorUpdateRow(row);
-    E.dirty++;
+    if (E.syntax == NULL)
+    {
+        row->hl_open_comment = 0;
+        return;
+    }
+
+    hlState st = {0, 0, 1, 0, (char)editorSyntaxEntry((rowNode *)row), HL_NORMAL};
+
+    // Short rows are cheap enough to highlight again as a whole
+    editorHighlightRun(row->render, row->rsize, row->hl, &st,
+                       row->rsize >= 2 * EDILITE_HL_CHECKPOINT ? row : nullptr, nullptr, 0, 0, nullptr);
+    editorSyntaxSetOpenComment(row, st.in_comment);
 }
 
-// Append a new row to the editor's row array
-void editorInsertRow(int at, const char *s, size_t len)
+// Bring stale nodes up to date, top down, until none is left up to row
+// `upto`. Loaded rows are highlighted again; unloaded runs only work out the
+// comment state they leave open.
+void editorSyntaxResolve(int upto)
 {
-    if (at < 0 || at > E.numrows)
+    int at;
+    while ((at = editorSyntaxFirstStale()) >= 0 && at <= upto)
+    {
+        int k;
+        rowNode *n = editorNodeFind(at, &k);
+        if (n->line < 0)
+        {
+            editorUpdateSyntax(&n->row);
+            continue;
+        }
+        editorSyntaxSetStale(&n->row, 0);
+        int in_comment = E.syntax ? editorSyntaxMapState(n->line, n->line + n->lines, editorSyntaxEntry(n)) : 0;
+        editorSyntaxSetOpenComment(&n->row, in_comment);
+    }
+}
+
+// Highlight again after render columns [at, at + oldlen) were replaced by
+// [at, at + newlen); hl after the edit has already been moved into place
+void editorUpdateSyntaxAt(erow *row, int at, int oldlen, int newlen)
+{
+    if (E.syntax == NULL)
+    {
+        memset(&row->hl[at], HL_NORMAL, newlen);
+        return;
+    }
+    if (row->hl_ncp == 0 || row->hl_stale)
+    {
+        editorUpdateSyntax(row);
+        return;
+    }
+
+    // Resume from the last saved state whose lookahead stopped short of the
+    // edit, and keep the states after the edit, shifted, to stop early at
+    int delta = newlen - oldlen;
+    int keep = 0;
+    while (keep < row->hl_ncp && row->hl_cp[keep].i <= at && row->hl_cp[keep].reach < at)
+        keep++;
+    int first = keep;
+    while (first < row->hl_ncp && row->hl_cp[first].i < at + oldlen)
+        first++;
+    int nold = row->hl_ncp - first;
+    hlState *old = (hlState *)malloc(sizeof(hlState) * (nold + 1));
+    for (int j = 0; j < nold; j++)
+    {
+        old[j] = row->hl_cp[first + j];
+        old[j].i += delta;
+        old[j].reach += delta;
+    }
+
+    hlState st = {0, 0, 1, 0, 0, HL_NORMAL};
+    if (keep > 0)
+    {
+        st = row->hl_cp[keep - 1];
+        row->hl_ncp = keep - 1; // The run saves this state again
+    }
+    else
+    {
+        st.in_comment = editorSyntaxEntry((rowNode *)row);
+        row->hl_ncp = 0;
+    }
+
+    int m = editorHighlightRun(row->render, row->rsize, row->hl, &st, row, old, nold, at + newlen, nullptr);
+    if (m >= 0)
+    {
+        // Lookahead before the meeting point may reach further than it did
+        for (int j = m; j < nold; j++)
+        {
+            if (row->hl_ncp % 16 == 0)
+                row->hl_cp = (hlState *)realloc(row->hl_cp, sizeof(hlState) * (row->hl_ncp + 16));
+            if (old[j].reach < st.reach)
+                old[j].reach = st.reach;
+            row->hl_cp[row->hl_ncp++] = old[j];
+        }
+    }
+    free(old);
+
+    if (m < 0)
+        editorSyntaxSetOpenComment(row, st.in_comment);
+}
+
+void editorSelectSyntaxHighlight()
+{
+    editorStopHighlighter();
+    // Cached block transfers were worked out under the previous syntax
+    if (E.hlblock)
+        for (size_t b = 0; b <= E.maplines / EDILITE_HL_BLOCK; b++)
+            E.hlblock[b].store(0, std::memory_order_relaxed);
+    E.syntax = NULL;
+    if (E.filename == NULL)
         return;
+    char *ext = strrchr(E.filename, '.');
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i])
+        {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i])))
+            {
+                E.syntax = s;
+                editorBuildKeywords();
+                editorSyntaxInitScan();
+                // Nothing is highlighted here; rows are as they come on screen
+                for (rowNode *n = editorNodeFirst(); n; n = editorNodeNext(n))
+                {
+                    editorSyntaxSetStale(&n->row, 1);
+                }
+                editorStartHighlighter();
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+/*** trigram index ***/
+uint32_t editorTrigramHash(uint32_t t)
+{
+    return (t & 0xffffff) * 0x9e3779b1u;
+}
 
-    E.row = (erow *)realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    std::memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+// Trigrams of `s` hashed to one bit each of 64, carrying the last bytes
+// over in `t` and how many have been seen in `n`
+uint64_t editorTrigramSign(const char *s, int len, uint32_t *t, int *n)
+{
+    uint64_t sign = 0;
+    for (int j = 0; j < len; j++)
+    {
+        *t = *t << 8 | (unsigned char)s[j];
+        if (++*n >= 3)
+            sign |= 1ULL << (editorTrigramHash(*t) >> 26);
+    }
+    return sign;
+}
 
-    for (int j = at + 1; j <= E.numrows; j++)
-        E.row[j].idx++;
+// Bits of the query's trigrams, in a block bitmap in `h` and a row
+// signature in `sign`; none when the query is too short to have any
+void editorTrigramQuery(const char *s, int len, std::vector<uint32_t> *h, uint64_t *sign)
+{
+    h->clear();
+    uint32_t t = 0;
+    int n = 0;
+    *sign = editorTrigramSign(s, len, &t, &n);
+    for (int j = 2; j < len; j++)
+        h->push_back((editorTrigramHash((unsigned char)s[j - 2] << 16 | (unsigned char)s[j - 1] << 8 | (unsigned char)s[j]) >> 16) %
+                     EDILITE_TRI_BITS);
+}
+
+// Whether block `b` might hold a line with all of `h`
+bool editorTrigramBlockMay(const std::vector<uint32_t> &h, size_t b)
+{
+    triIndex *ti = E.trigrams;
+    if (b >= ti->built.load(std::memory_order_acquire))
+        return true;
+    const uint64_t *bits = &ti->bits[b * (EDILITE_TRI_BITS / 64)];
+    for (uint32_t x : h)
+    {
+        if (!(bits[x >> 6] >> (x & 63) & 1))
+            return false;
+    }
+    return true;
+}
 
-    E.row[at].idx = at;
+size_t editorTrigramBlockOf(size_t line)
+{
+    triIndex *ti = E.trigrams;
+    return std::upper_bound(ti->first, ti->first + ti->nblocks + 1, line) - ti->first - 1;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = (char *)malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// First mapped line in [line, end) that might hold a match of `h`, and in
+// `stop` the first line after it where a block ruled out for `h` begins
+size_t editorTrigramNext(const std::vector<uint32_t> &h, size_t line, size_t end, size_t *stop)
+{
+    *stop = end;
+    if (!E.trigrams || h.empty() || line >= end)
+        return line;
+    size_t b = editorTrigramBlockOf(line);
+    while (line < end && !editorTrigramBlockMay(h, b))
+        line = E.trigrams->first[++b];
+    if (line >= end)
+        return end;
+    size_t c = b + 1;
+    while (E.trigrams->first[c] < end && editorTrigramBlockMay(h, c))
+        c++;
+    if (E.trigrams->first[c] < end)
+        *stop = E.trigrams->first[c];
+    return line;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = nullptr;
-    E.row[at].hl = nullptr;
-    E.row[at].hl_open_comment = 0;
+void editorTrigramMain(triIndex *ti)
+{
+    for (size_t b = 0; b < ti->nblocks; b++)
+    {
+        while (ti->busy.load(std::memory_order_relaxed) && !ti->stop.load(std::memory_order_relaxed))
+            usleep(1000);
+        if (ti->stop.load(std::memory_order_relaxed))
+            return;
+        uint64_t *bits = &ti->bits[b * (EDILITE_TRI_BITS / 64)];
+        const unsigned char *p = (const unsigned char *)E.map + E.lineoff[ti->first[b]];
+        const unsigned char *end = (const unsigned char *)E.map + E.lineoff[ti->first[b + 1]];
+        uint32_t t = 0;
+        for (int k = 0; k < 2 && p < end; k++)
+            t = t << 8 | *p++;
+        for (; p < end; p++)
+        {
+            t = t << 8 | *p;
+            uint32_t x = (editorTrigramHash(t) >> 16) % EDILITE_TRI_BITS;
+            bits[x >> 6] |= 1ULL << (x & 63);
+        }
+        ti->built.store(b + 1, std::memory_order_release);
+    }
+}
 
-    editorUpdateRow(&E.row[at]);
-    E.numrows++;
-    E.dirty++;
+// Bytes the index takes, once built
+size_t editorTrigramMemory()
+{
+    triIndex *ti = E.trigrams;
+    return ti->nblocks * (EDILITE_TRI_BITS / 8) + (ti->nblocks + 1) * sizeof(size_t);
 }
 
-void editorRowDelChar(erow *row, int at)
+// Index a large mapped file in the background. Blocks end on a line
+// boundary, so no match is ever cut between two of them.
+void editorStartTrigrams()
 {
-    if (at < 0 || at >= row->size)
+    if (E.trigrams || !E.map || E.mapsize < EDILITE_TRI_MIN)
         return;
+    triIndex *ti = new triIndex();
+    size_t cap = E.mapsize / EDILITE_TRI_BYTES + 2;
+    ti->first = (size_t *)malloc(sizeof(size_t) * cap);
+    ti->nblocks = 0;
+    for (size_t line = 0; line < E.maplines;)
+    {
+        ti->first[ti->nblocks++] = line;
+        size_t goal = E.lineoff[line] + EDILITE_TRI_BYTES;
+        size_t next = std::lower_bound(E.lineoff, E.lineoff + E.maplines, goal) - E.lineoff;
+        line = next > line ? next : line + 1;
+    }
+    ti->first[ti->nblocks] = E.maplines;
+    ti->bits = (uint64_t *)calloc(ti->nblocks, EDILITE_TRI_BITS / 8);
+    ti->stop = false;
+    ti->busy = false;
+    ti->built = 0;
+    ti->reported = false;
+    E.trigrams = ti;
+    ti->thread = std::thread(editorTrigramMain, ti);
+}
 
-    std::memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+// Needed before the mapping changes; the index goes with it
+void editorStopTrigrams()
+{
+    if (!E.trigrams)
+        return;
+    E.trigrams->stop = true;
+    E.trigrams->thread.join();
+    free(E.trigrams->first);
+    free(E.trigrams->bits);
+    delete E.trigrams;
+    E.trigrams = nullptr;
 }
 
-void editorFreeRow(erow *row)
+/*** journal ***/
+// Write out the records gathered so far; with `sync` also wait for them to
+// reach the disk
+void editorJournalFlush(bool sync)
+{
+    editJournal *j = &E.journal;
+    if (j->fd == -1)
+        return;
+    size_t off = 0;
+    while (off < j->len)
+    {
+        ssize_t w = write(j->fd, j->buf + off, j->len - off);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            break; // The journal is a safety net; the edit itself went through
+        off += w;
+    }
+    j->len = 0;
+    if (sync)
+    {
+        fdatasync(j->fd);
+        j->sync_at = 0;
+    }
+}
+
+void editorJournalVarint(uint64_t v)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    editJournal *j = &E.journal;
+    do
+    {
+        unsigned char b = v & 0x7f;
+        v >>= 7;
+        j->buf[j->len++] = b | (v ? 0x80 : 0);
+    } while (v);
 }
 
-void editorDelRow(int at)
+// Append one record; typing only costs a few bytes of memcpy. The event
+// loop syncs the records within EDILITE_JOURNAL_SYNC ms.
+void editorJournalRecord(int op, int a, int b, const char *s, size_t len)
 {
-    if (at < 0 || at >= E.numrows)
+    editJournal *j = &E.journal;
+    if (j->fd == -1 || j->replaying)
         return;
+    size_t need = j->len + 1 + 3 * 10 + len;
+    if (need > j->cap)
+    {
+        j->cap = need > 2 * j->cap ? need : 2 * j->cap;
+        j->buf = (char *)realloc(j->buf, j->cap);
+    }
+    j->buf[j->len++] = op;
+    editorJournalVarint(a);
+    editorJournalVarint(b);
+    editorJournalVarint(len);
+    if (len)
+        memcpy(j->buf + j->len, s, len);
+    j->len += len;
+    if (!j->sync_at)
+        j->sync_at = editorNowMs() + EDILITE_JOURNAL_SYNC;
+    if (j->len >= EDILITE_JOURNAL_BUF)
+        editorJournalFlush(false);
+}
 
-    editorFreeRow(&E.row[at]);
-    std::memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++)
-        E.row[j].idx--;
+/*** undo ***/
+// Memory the history holds, counting whole arena chunks
+size_t editorUndoMemory()
+{
+    undoLog *u = &E.undo;
+    return u->arenabytes + u->ops.size() * sizeof(undoOp) + u->groups.size() * sizeof(undoGroup);
+}
 
-    E.numrows--;
-    E.dirty++;
+// Arena position the next payload byte would get
+size_t editorUndoEnd()
+{
+    undoLog *u = &E.undo;
+    return u->arena.empty() ? 0 : u->arena.back().pos + u->arena.back().len;
 }
 
-void editorRowAppendString(erow *row, const char *s, size_t len)
+// Bytes of a new arena chunk for a payload of `len`. A small history gets
+// small chunks, so a few of them fit and the oldest can be let go.
+size_t editorUndoChunkSize(size_t len)
 {
-    row->chars = (char *)realloc(row->chars, row->size + len + 1);
-    std::memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    size_t size = EDILITE_UNDO_MAX / 8 < EDILITE_UNDO_CHUNK ? EDILITE_UNDO_MAX / 8 : EDILITE_UNDO_CHUNK;
+    return len > size ? len : size;
 }
 
-/*** editor operations ***/
-void editorInsertChar(int c)
+// Memory a payload of `len` adds: nothing while it fits the last chunk,
+// else the chunk it needs
+size_t editorUndoGrowth(size_t len)
 {
-    if (E.cy == E.numrows)
+    undoLog *u = &E.undo;
+    if (!u->arena.empty() && u->arena.back().cap - u->arena.back().len >= len)
+        return 0;
+    return editorUndoChunkSize(len);
+}
+
+char *editorUndoAlloc(size_t len)
+{
+    undoLog *u = &E.undo;
+    if (u->arena.empty() || u->arena.back().cap - u->arena.back().len < len)
     {
-        editorInsertRow(E.numrows, "", 0); // Append a new empty row if needed
+        undoChunk c;
+        c.cap = editorUndoChunkSize(len);
+        c.data = (char *)malloc(c.cap);
+        c.pos = editorUndoEnd();
+        c.len = 0;
+        u->arena.push_back(c);
+        u->arenabytes += c.cap;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    undoChunk *c = &u->arena.back();
+    char *p = c->data + c->len;
+    c->len += len;
+    return p;
 }
 
-void editorDelChar()
+// Payload at arena position `pos`; a payload never spans chunks
+const char *editorUndoData(size_t pos)
 {
-    if (E.cy == E.numrows)
-        return;
+    std::deque<undoChunk> &arena = E.undo.arena;
+    size_t lo = 0, hi = arena.size();
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (arena[mid].pos <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return arena[lo].data + (pos - arena[lo].pos);
+}
 
-    if (E.cx == 0 && E.cy == 0)
+void editorUndoClear()
+{
+    undoLog *u = &E.undo;
+    for (size_t j = 0; j < u->arena.size(); j++)
+        free(u->arena[j].data);
+    u->arena.clear();
+    u->arenabytes = 0;
+    u->ops.clear();
+    u->opbase = 0;
+    u->groups.clear();
+    u->done = 0;
+    u->open = false;
+}
+
+// Drop the groups that were undone; a new edit takes their place
+void editorUndoForget()
+{
+    undoLog *u = &E.undo;
+    if (u->done == u->groups.size())
         return;
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0)
+    size_t first = u->groups[u->done].first;
+    size_t cut = first - u->opbase < u->ops.size() ? u->ops[first - u->opbase].pos : editorUndoEnd();
+    u->ops.resize(first - u->opbase);
+    u->groups.resize(u->done);
+    while (!u->arena.empty() && u->arena.back().pos >= cut)
     {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        u->arenabytes -= u->arena.back().cap;
+        free(u->arena.back().data);
+        u->arena.pop_back();
     }
-    else
+    if (!u->arena.empty() && cut < editorUndoEnd())
+        u->arena.back().len = cut - u->arena.back().pos;
+}
+
+void editorUndoDropOldest()
+{
+    undoLog *u = &E.undo;
+    size_t next = u->groups.size() > 1 ? u->groups[1].first : u->opbase + u->ops.size();
+    for (; u->opbase < next; u->opbase++)
+        u->ops.pop_front();
+    u->groups.pop_front();
+    u->done--;
+    // Chunks that end before the oldest payload still needed go
+    size_t keep = u->ops.empty() ? editorUndoEnd() : u->ops.front().pos;
+    while (u->arena.size() > 1 && u->arena.front().pos + u->arena.front().len <= keep)
     {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        u->arenabytes -= u->arena.front().cap;
+        free(u->arena.front().data);
+        u->arena.pop_front();
     }
 }
 
-void editorInsertNewline()
+// Called for each key before it is handled: its edits start a new group,
+// unless it types a character right after the ones typed before it
+void editorUndoBegin(bool typing)
 {
-    if (E.cy == E.numrows)
+    undoLog *u = &E.undo;
+    if (u->open)
     {
-        editorInsertRow(E.numrows, "", 0); // Insert an empty row if at the end of file
+        u->groups.back().ecy = E.cy;
+        u->groups.back().ecx = E.cx;
+        if (!typing || !u->typing)
+            u->open = false;
     }
-    else if (E.cx == 0)
+    u->extend = u->open;
+    u->typing = typing;
+    u->lost = false;
+    u->cy = E.cy;
+    u->cx = E.cx;
+}
+
+// Record an edit of `len` payload bytes, copied from `s`, or left for the
+// caller to fill in through the pointer returned when `s` is null. Returns
+// null when the edit is not recorded.
+char *editorUndoRecord(int type, int row, int arg, const char *s, size_t len)
+{
+    undoLog *u = &E.undo;
+    if (u->applying || u->lost || E.journal.replaying || len == 0)
+        return nullptr;
+
+    // Typing extends the insert before it while it has room in its chunk;
+    // anything else typed starts a group of its own
+    if (u->open && u->extend)
     {
-        editorInsertRow(E.cy, "", 0);
+        u->extend = false;
+        undoOp *last = &u->ops.back();
+        undoChunk *c = &u->arena.back();
+        if (type == UNDO_INSERT && last->type == UNDO_INSERT && last->row == row &&
+            last->arg + (int)last->len == arg && last->pos + last->len == editorUndoEnd() &&
+            c->cap - c->len >= len)
+        {
+            memcpy(c->data + c->len, s, len);
+            c->len += len;
+            last->len += len;
+            return c->data + c->len - len;
+        }
+        u->open = false;
+    }
+
+    if (!u->open)
+    {
+        editorUndoForget();
+        undoGroup g;
+        g.first = u->opbase + u->ops.size();
+        g.cy = g.ecy = u->cy;
+        g.cx = g.ecx = u->cx;
+        u->groups.push_back(g);
+        u->done = u->groups.size();
+        u->open = true;
+    }
+
+    // Dropping old groups frees whole chunks but never the last one, so
+    // what the payload adds stays the same while they go
+    size_t need = editorUndoGrowth(len) + sizeof(undoOp);
+    while (editorUndoMemory() + need > EDILITE_UNDO_MAX && u->groups.size() > 1)
+        editorUndoDropOldest();
+    if (editorUndoMemory() + need > EDILITE_UNDO_MAX)
+    {
+        // This key's edits alone are more than the history holds
+        editorUndoClear();
+        u->lost = true;
+        return nullptr;
+    }
+
+    undoOp op;
+    op.type = type;
+    op.row = row;
+    op.arg = arg;
+    op.len = len;
+    char *p = editorUndoAlloc(len);
+    op.pos = p - u->arena.back().data + u->arena.back().pos;
+    if (s)
+        memcpy(p, s, len);
+    u->ops.push_back(op);
+    return p;
+}
+
+// Append one row to a row list
+char *editorRowListPut(char *p, const char *s, int len)
+{
+    uint32_t n = len;
+    memcpy(p, &n, sizeof(n));
+    if (len)
+        memcpy(p + sizeof(n), s, len);
+    return p + sizeof(n) + len;
+}
+
+// Whether `s` is a row list of exactly `count` rows
+bool editorRowListValid(const char *s, size_t len, int count)
+{
+    size_t off = 0;
+    for (int j = 0; j < count; j++)
+    {
+        uint32_t n;
+        if (len - off < sizeof(n))
+            return false;
+        memcpy(&n, s + off, sizeof(n));
+        off += sizeof(n);
+        if (len - off < n)
+            return false;
+        off += n;
+    }
+    return count > 0 && off == len;
+}
+
+/*** row operations ***/
+// Give a new row the text `s`; a short one stays in the row itself
+void editorRowInitChars(erow *row, const char *s, int len)
+{
+    if (len + 1 <= EDILITE_ROW_INLINE)
+    {
+        row->chars = row->inl;
+        row->cap = EDILITE_ROW_INLINE;
     }
     else
     {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row->cap = editorSlabSize(len + 1);
+        row->chars = (char *)editorSlabAlloc(row->cap);
+    }
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->size = len;
+    row->gap = len;
+}
 
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+// Move chars to a block of at least `cap` bytes, keeping their bytes in place
+void editorRowGrowChars(erow *row, int cap)
+{
+    cap = editorSlabSize(cap);
+    if (row->chars == row->inl)
+    {
+        row->chars = (char *)editorSlabAlloc(cap);
+        memcpy(row->chars, row->inl, row->cap);
+    }
+    else
+    {
+        row->chars = (char *)editorSlabRealloc(row->chars, row->cap, cap);
     }
+    row->cap = cap;
+}
 
-    // Move cursor to the beginning of the new row
-    E.cy++;
-    E.cx = 0;
-    E.dirty++;
+// Character `j` of the row, looking past the gap
+char editorRowChar(erow *row, int j)
+{
+    return row->chars[j < row->gap ? j : j + row->cap - 1 - row->size];
 }
 
-/*** file i/o ***/
-std::string editorRowsToString(int &buflen)
+// Move the gap so it starts at `at`, making room for at least `need` bytes
+void editorRowMoveGap(erow *row, int at, int need)
 {
-    buflen = 0;
-    for (int j = 0; j < E.numrows; j++)
+    if (E.gaprow && E.gaprow != row)
+        editorRowCloseGap(E.gaprow);
+    E.gaprow = row;
+
+    int gaplen = row->cap - 1 - row->size;
+    if (gaplen < need)
     {
-        buflen += E.row[j].size + 1; // +1 for newline character
+        // Grow geometrically so a run of typing reallocates only now and then
+        int cap = row->cap * 2;
+        if (cap < row->size + need + 1)
+            cap = row->size + need + 1;
+        int tail = row->size - row->gap;
+        editorRowGrowChars(row, cap);
+        memmove(&row->chars[row->cap - 1 - tail], &row->chars[row->gap + gaplen], tail);
+        gaplen = row->cap - 1 - row->size;
     }
 
-    std::string buffer;
-    buffer.reserve(buflen); // Reserve exact space to avoid reallocations
+    if (at < row->gap)
+        memmove(&row->chars[at + gaplen], &row->chars[at], row->gap - at);
+    else
+        memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen], at - row->gap);
+    row->gap = at;
+}
 
-    for (int j = 0; j < E.numrows; j++)
+// Join the text around the gap so chars can be read as one string again
+void editorRowCloseGap(erow *row)
+{
+    if (row->gap < row->size)
     {
-        buffer.append(E.row[j].chars);
-        buffer.append("\n"); // Append newline
+        int gaplen = row->cap - 1 - row->size;
+        memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen], row->size - row->gap);
+        row->gap = row->size;
     }
-    return buffer;
+    row->chars[row->size] = '\0';
+    if (E.gaprow == row)
+        E.gaprow = nullptr;
 }
 
-void editorSave()
+// Number of tabs before char column `cx`
+int editorRowTabsBefore(erow *row, int cx)
 {
-    if (E.filename == nullptr)
+    int lo = 0, hi = row->ntabs;
+    while (lo < hi)
     {
-        E.filename = strdup(editorPrompt("Save as: %s (ESC to cancel)", NULL).c_str());
-        if (E.filename == nullptr || E.filename[0] == '\0')
-        { // Check for cancel
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
-        editorSelectSyntaxHighlight();
+        int mid = (lo + hi) / 2;
+        if (row->tabs[mid].cx < cx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Columns convert through the row's tab index: between two tabs every
+// char takes one column, so only the tab before the column is looked up
+int editorRowCxToRx(erow *row, int cx)
+{
+    int k = editorRowTabsBefore(row, cx);
+    if (k == 0)
+        return cx;
+    return row->tabs[k - 1].rx + (cx - row->tabs[k - 1].cx - 1);
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+    // Tabs that end at or before `rx`
+    int lo = 0, hi = row->ntabs;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (row->tabs[mid].rx <= rx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int cx = lo ? row->tabs[lo - 1].cx + 1 + (rx - row->tabs[lo - 1].rx) : rx;
+    int next = lo < row->ntabs ? row->tabs[lo].cx : row->size;
+    return cx < next ? cx : next;
+}
+
+void editorRowReserveTabs(erow *row, int ntabs)
+{
+    if (ntabs > row->tabcap)
+    {
+        int tabcap = ntabs > 2 * row->tabcap ? ntabs : 2 * row->tabcap;
+        size_t size = editorSlabSize(sizeof(rowTab) * tabcap);
+        row->tabs = (rowTab *)editorSlabRealloc(row->tabs, sizeof(rowTab) * row->tabcap, size);
+        row->tabcap = size / sizeof(rowTab);
+    }
+}
+
+// Make room for `rsize` render columns plus the terminator
+void editorRowReserveRender(erow *row, int rsize)
+{
+    if (rsize + 1 <= row->rcap)
+        return;
+    int rcap = row->rcap * 2;
+    if (rcap < rsize + 1)
+        rcap = rsize + 1;
+    // hl follows render in the same block, so it moves up as that grows
+    rcap = editorSlabSize(2 * rcap) / 2;
+    row->render = (char *)editorSlabRealloc(row->render, 2 * row->rcap, 2 * rcap);
+    row->hl = (unsigned char *)row->render + rcap;
+    memmove(row->hl, row->render + row->rcap, row->rcap);
+    row->rcap = rcap;
+}
+
+// Free render and hl of a row that is drawn from its chars
+void editorRowDropRender(erow *row)
+{
+    editorSlabFree(row->render, 2 * row->rcap);
+    free(row->hl_cp);
+    row->render = nullptr;
+    row->hl = nullptr;
+    row->hl_cp = nullptr;
+    row->hl_ncp = 0;
+    row->rcap = 0;
+    row->rsize = row->size;
+    row->ntabs = 0;
+}
+
+// Copy `len` chars of a row from `at` on, whichever side of the gap they are
+void editorRowCopy(erow *row, int at, int len, char *out)
+{
+    int before = row->gap - at;
+    if (before > len)
+        before = len;
+    if (before < 0)
+        before = 0;
+    memcpy(out, &row->chars[at], before);
+    memcpy(out + before, &row->chars[at + before + row->cap - 1 - row->size], len - before);
+}
+
+void editorRowFreeChunks(erow *row)
+{
+    for (int k = 0; k < row->nchunks; k++)
+        free(row->chunks[k].hl);
+    free(row->chunks);
+    row->chunks = nullptr;
+    row->nchunks = 0;
+}
+
+// Chunk holding char `at`; a char on a boundary goes with the chunk it ends
+int editorChunkAt(erow *row, int at)
+{
+    int lo = 0, hi = row->nchunks - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (row->chunks[mid].start + row->chunks[mid].size < at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Lex chunk `k` from its entry state, copying its highlighting to `hl` if
+// given. The run reads a copy of the chunk and the text after it, widened
+// until the lexer's lookahead stays inside it. Returns the entry state of
+// the next chunk, and leaves the state at the end of the run in `*end`.
+hlState editorChunkLex(erow *row, int k, unsigned char *hl, hlState *end)
+{
+    static char *text = nullptr;
+    static unsigned char *thl = nullptr;
+    static int cap = 0;
+
+    rowChunk *c = &row->chunks[k];
+    int from = c->entry.i;
+    int stop = c->start + c->size;
+    for (int margin = EDILITE_HL_CHECKPOINT;; margin *= 4)
+    {
+        int to = row->size - stop > margin ? stop + margin : row->size;
+        int len = to - from;
+        if (len + 1 > cap)
+        {
+            cap = len + 1;
+            text = (char *)realloc(text, cap);
+            thl = (unsigned char *)realloc(thl, cap);
+        }
+        editorRowCopy(row, from, len, text);
+        text[len] = '\0';
+
+        hlState st = c->entry;
+        st.i -= from;
+        st.reach -= from;
+        hlState next = st;
+        hlWindow win = {from, stop - from, &next};
+        // Always with highlighting, as keywords move the lexer through the
+        // text differently from a run that only follows the comment state
+        editorHighlightRun(text, len, thl, &st, nullptr, nullptr, 0, 0, &win);
+        if (to < row->size && st.reach >= len)
+            continue;
+
+        if (hl)
+            memcpy(hl, &thl[c->start - from], c->size);
+        next.i += from;
+        next.reach += from;
+        st.i += from;
+        st.reach += from;
+        if (end)
+            *end = st;
+        return next;
+    }
+}
+
+// Work out the entry state of every chunk, lexing the row without keeping
+// any highlighting; chunks are highlighted again when drawn
+void editorChunkSyntax(erow *row)
+{
+    hlState st = {0, 0, 1, 0, (char)editorSyntaxEntry((rowNode *)row), HL_NORMAL};
+    row->chunks[0].entry = st;
+    for (int k = 0; k < row->nchunks; k++)
+    {
+        free(row->chunks[k].hl);
+        row->chunks[k].hl = nullptr;
+        if (!E.syntax)
+            continue;
+        hlState next = editorChunkLex(row, k, nullptr, &st);
+        if (k + 1 < row->nchunks)
+            row->chunks[k + 1].entry = next;
+    }
+    editorSyntaxSetOpenComment(row, E.syntax ? st.in_comment : 0);
+}
+
+// Highlight a short row as a whole and keep the runs of its highlighting.
+// A row with more runs than fit gets render and hl like a longer one.
+void editorCompactSyntax(erow *row)
+{
+    static char text[2 * EDILITE_HL_CHECKPOINT + 1];
+    static unsigned char hl[2 * EDILITE_HL_CHECKPOINT];
+    if (row->size >= 2 * EDILITE_HL_CHECKPOINT)
+    {
+        // Grown out of the short rows
+        editorUpdateRow(row);
+        return;
+    }
+    editorRowCopy(row, 0, row->size, text);
+    text[row->size] = '\0';
+    memset(hl, HL_NORMAL, row->size);
+    if (E.syntax)
+    {
+        hlState st = {0, 0, 1, 0, (char)editorSyntaxEntry((rowNode *)row), HL_NORMAL};
+        editorHighlightRun(text, row->size, hl, &st, nullptr, nullptr, 0, 0, nullptr);
+        editorSyntaxSetOpenComment(row, st.in_comment);
+    }
+    else
+    {
+        row->hl_open_comment = 0;
+    }
+
+    int n = 0;
+    for (int j = 0; j < row->size; j++)
+    {
+        if (n > 0 && row->spans[n - 1].hl == hl[j])
+        {
+            row->spans[n - 1].end = j + 1;
+            continue;
+        }
+        if (n == EDILITE_ROW_SPANS)
+        {
+            row->compact = 0;
+            editorRowReserveRender(row, row->size);
+            memcpy(row->render, text, row->size + 1);
+            memcpy(row->hl, hl, row->size);
+            return;
+        }
+        row->spans[n].end = j + 1;
+        row->spans[n++].hl = hl[j];
+    }
+    row->nspans = n;
+}
+
+// Highlighting of chunk `k`, worked out when it is first needed
+unsigned char *editorChunkHl(erow *row, int k)
+{
+    rowChunk *c = &row->chunks[k];
+    if (!c->hl)
+    {
+        c->hl = (unsigned char *)malloc(c->size ? c->size : 1);
+        if (E.syntax)
+            editorChunkLex(row, k, c->hl, nullptr);
+        else
+            memset(c->hl, HL_NORMAL, c->size);
+    }
+    return c->hl;
+}
+
+// Drop the highlighting of the chunks outside columns [from, to)
+void editorChunkTrim(erow *row, int from, int to)
+{
+    for (int k = 0; k < row->nchunks; k++)
+    {
+        rowChunk *c = &row->chunks[k];
+        if (c->hl && (c->start + c->size <= from || c->start >= to))
+        {
+            free(c->hl);
+            c->hl = nullptr;
+        }
+    }
+}
+
+// Point `render` at up to `n` chars of a row drawn from its chars, from
+// column `rx` on and stopping at the gap; returns how many
+int editorRowChars(erow *row, int rx, int n, const char **render)
+{
+    if (rx < row->gap)
+    {
+        *render = &row->chars[rx];
+        return n < row->gap - rx ? n : row->gap - rx;
+    }
+    *render = &row->chars[rx + row->cap - 1 - row->size];
+    return n;
+}
+
+// Render and highlighting of a row from column `rx` on, for as many columns
+// as they are stored together; returns that many, 0 past the end. `hl` is
+// null when all of them have the highlight `style`.
+int editorRowSpan(erow *row, int rx, const char **render, const unsigned char **hl, unsigned char *style)
+{
+    if (rx >= row->rsize)
+        return 0;
+    if (row->compact)
+    {
+        int k = 0;
+        while (k < row->nspans && row->spans[k].end <= rx)
+            k++;
+        *hl = nullptr;
+        *style = k < row->nspans ? row->spans[k].hl : (unsigned char)HL_NORMAL;
+        return editorRowChars(row, rx, (k < row->nspans ? row->spans[k].end : row->rsize) - rx, render);
+    }
+    if (!row->chunks)
+    {
+        *render = &row->render[rx];
+        *hl = &row->hl[rx];
+        return row->rsize - rx;
+    }
+    int k = editorChunkAt(row, rx);
+    if (row->chunks[k].start + row->chunks[k].size == rx)
+        k++;
+    rowChunk *c = &row->chunks[k];
+    *hl = editorChunkHl(row, k) + (rx - c->start);
+    return editorRowChars(row, rx, c->start + c->size - rx, render);
+}
+
+// Lay a long row out in chunks again, with nothing lexed yet
+void editorRowChunk(erow *row)
+{
+    editorRowFreeChunks(row);
+    row->nchunks = (row->size + EDILITE_ROW_CHUNK - 1) / EDILITE_ROW_CHUNK;
+    row->chunks = (rowChunk *)calloc(row->nchunks, sizeof(rowChunk));
+    for (int k = 0; k < row->nchunks; k++)
+    {
+        row->chunks[k].start = k * EDILITE_ROW_CHUNK;
+        row->chunks[k].size = row->size - k * EDILITE_ROW_CHUNK < EDILITE_ROW_CHUNK ? row->size - k * EDILITE_ROW_CHUNK : EDILITE_ROW_CHUNK;
+        row->chunks[k].entry.i = -1;
+    }
+}
+
+// Fit the highlighting of a chunk to its new size; with syntax the chunk
+// is lexed again afterwards
+void editorChunkResize(rowChunk *c)
+{
+    if (!c->hl)
+        return;
+    c->hl = (unsigned char *)realloc(c->hl, c->size ? c->size : 1);
+    if (!E.syntax)
+        memset(c->hl, HL_NORMAL, c->size);
+}
+
+// Chars [at, at + nremoved) of a long row were replaced by `added` chars.
+// Only the chunks the edit falls in change; from the chunk holding it on,
+// chunks are lexed again until one starts in the same state as before.
+void editorChunkEdit(erow *row, int at, int added, int nremoved)
+{
+    int delta = added - nremoved;
+    int end = at + nremoved;
+    row->rsize = row->size;
+    for (int k = 0; k < row->nchunks; k++)
+    {
+        rowChunk *c = &row->chunks[k];
+        int from = c->start > at ? c->start : at;
+        int to = c->start + c->size < end ? c->start + c->size : end;
+        if (to > from)
+        {
+            c->size -= to - from;
+            editorChunkResize(c);
+        }
+        // States past the edit move with the text; ones inside it are gone
+        if (k == 0)
+            continue;
+        if (c->entry.i >= end)
+        {
+            c->entry.i += delta;
+            c->entry.reach += delta;
+        }
+        else if (c->entry.i >= at && nremoved)
+        {
+            c->entry.i = -1;
+        }
+    }
+
+    // Emptied chunks go, the first one stays
+    int n = 1;
+    for (int k = 1; k < row->nchunks; k++)
+    {
+        if (row->chunks[k].size > 0)
+            row->chunks[n++] = row->chunks[k];
+        else
+            free(row->chunks[k].hl);
+    }
+    row->nchunks = n;
+    for (int k = 1; k < n; k++)
+        row->chunks[k].start = row->chunks[k - 1].start + row->chunks[k - 1].size;
+
+    int first = editorChunkAt(row, at);
+    rowChunk *c = &row->chunks[first];
+    c->size += added;
+    editorChunkResize(c);
+    for (int k = first + 1; k < n; k++)
+        row->chunks[k].start += added;
+    if (c->size > 2 * EDILITE_ROW_CHUNK)
+    {
+        row->chunks = (rowChunk *)realloc(row->chunks, sizeof(rowChunk) * (n + 1));
+        memmove(&row->chunks[first + 2], &row->chunks[first + 1], sizeof(rowChunk) * (n - first - 1));
+        row->nchunks = ++n;
+        c = &row->chunks[first];
+        rowChunk *half = &row->chunks[first + 1];
+        half->size = c->size / 2;
+        c->size -= half->size;
+        half->start = c->start + c->size;
+        half->entry.i = -1;
+        half->hl = nullptr;
+        editorChunkResize(c);
+    }
+
+    if (!E.syntax)
+        return;
+    if (row->hl_stale || c->entry.i < 0)
+    {
+        editorUpdateSyntax(row);
+        return;
+    }
+
+    // Start from a chunk whose state did not look ahead into the edit, and
+    // that no token runs into from the chunk before
+    int k = first;
+    while (k > 0 && (row->chunks[k].entry.reach >= at || row->chunks[k].entry.i < row->chunks[k].start))
+        k--;
+    for (;; k++)
+    {
+        // Chunks on screen keep their highlighting, done along the way
+        hlState st;
+        hlState next = editorChunkLex(row, k, row->chunks[k].hl, &st);
+        if (k + 1 == row->nchunks)
+        {
+            editorSyntaxSetOpenComment(row, st.in_comment);
+            return;
+        }
+        hlState *old = &row->chunks[k + 1].entry;
+        if (k >= first && next.i >= at + added && next.i == old->i && next.prev_sep == old->prev_sep &&
+            next.in_string == old->in_string && next.in_comment == old->in_comment && next.prev_hl == old->prev_hl)
+        {
+            // Lookahead before the meeting point may reach further than it did
+            for (int j = k + 1; j < row->nchunks; j++)
+            {
+                if (row->chunks[j].entry.reach < next.reach)
+                    row->chunks[j].entry.reach = next.reach;
+            }
+            return;
+        }
+        *old = next;
+    }
+}
+
+// Expand the row into render and take its trigram signature; hl is left
+// for the syntax highlighter
+void editorRenderRow(erow *row)
+{
+    if (row == E.gaprow)
+        editorRowCloseGap(row);
+
+    // For each tab, we may need up to 8 spaces, so allocate accordingly
+    int tabs = 0;
+    for (int j = 0; j < row->size; j++)
+    {
+        if (row->chars[j] == '\t')
+            tabs++;
+    }
+
+    uint32_t t = 0;
+    int n = 0;
+    row->tri = editorTrigramSign(row->chars, row->size, &t, &n);
+
+    // A long row without tabs is drawn from its chars
+    row->compact = 0;
+    if (row->size >= EDILITE_LONG_ROW && tabs == 0)
+    {
+        editorRowDropRender(row);
+        editorRowChunk(row);
+        return;
+    }
+    editorRowFreeChunks(row);
+
+    // So is a short one, which keeps its highlighting as a few runs
+    if (row->size < 2 * EDILITE_HL_CHECKPOINT && tabs == 0)
+    {
+        editorRowDropRender(row);
+        row->compact = 1;
+        row->nspans = 0;
+        return;
+    }
+
+    editorRowReserveRender(row, row->size + tabs * (EDILITE_TAB_STOP - 1));
+    editorRowReserveTabs(row, tabs);
+    row->ntabs = 0;
+    int idx = 0;
+
+    for (int j = 0; j < row->size; j++)
+    {
+        if (row->chars[j] == '\t')
+        {
+            row->render[idx++] = ' ';
+            while (idx % (EDILITE_TAB_STOP) != 0)
+                row->render[idx++] = ' ';
+            row->tabs[row->ntabs].cx = j;
+            row->tabs[row->ntabs++].rx = idx;
+        }
+        else
+        {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+void editorUpdateRow(erow *row)
+{
+    editorRenderRow(row);
+    editorUpdateSyntax(row);
+}
+
+// Render column reached after expanding `len` chars from column `rx`; with
+// `out` set the expansion is also written there
+int editorRenderChars(const char *s, int len, int rx, char *out)
+{
+    for (int j = 0; j < len; j++)
+    {
+        if (s[j] == '\t')
+        {
+            do
+            {
+                if (out)
+                    *out++ = ' ';
+                rx++;
+            } while (rx % EDILITE_TAB_STOP != 0);
+        }
+        else
+        {
+            if (out)
+                *out++ = s[j];
+            rx++;
+        }
+    }
+    return rx;
+}
+
+// Patch render, tab index and highlighting of a row that is not in chunks.
+// Past the first tab that follows the edit, render is unchanged and only
+// moves, since that tab ends on a tab stop either way.
+void editorRenderRowAt(erow *row, int at, int added, const char *removed, int nremoved)
+{
+    int rx = editorRowCxToRx(row, at);
+    const char *after = &row->chars[row->cap - 1 - row->size + row->gap];
+    const char *tab = (const char *)memchr(after, '\t', row->size - row->gap);
+    int seg = tab ? tab - after + 1 : 0;
+
+    int oldend = editorRenderChars(after, seg, editorRenderChars(removed, nremoved, rx, nullptr), nullptr);
+    int newend = editorRenderChars(after, seg, editorRenderChars(&row->chars[at], added, rx, nullptr), nullptr);
+    int delta = newend - oldend;
+
+    editorRowReserveRender(row, row->rsize + delta);
+    memmove(&row->render[newend], &row->render[oldend], row->rsize - oldend + 1);
+    memmove(&row->hl[newend], &row->hl[oldend], row->rsize - oldend);
+    int end = editorRenderChars(&row->chars[at], added, rx, &row->render[rx]);
+    editorRenderChars(after, seg, end, &row->render[end]);
+    row->rsize += delta;
+
+    // The tab index loses the removed tabs and gains the added ones; the
+    // tabs after them move by the same amount as the render
+    int first = editorRowTabsBefore(row, at);
+    int last = editorRowTabsBefore(row, at + nremoved);
+    int ntabs = 0;
+    for (int j = at; j < at + added; j++)
+        ntabs += row->chars[j] == '\t';
+    editorRowReserveTabs(row, row->ntabs - (last - first) + ntabs);
+    if (row->ntabs > last)
+        memmove(&row->tabs[first + ntabs], &row->tabs[last], sizeof(rowTab) * (row->ntabs - last));
+    row->ntabs += ntabs - (last - first);
+    for (int j = first + ntabs; j < row->ntabs; j++)
+    {
+        row->tabs[j].cx += added - nremoved;
+        row->tabs[j].rx += delta;
+    }
+    for (int j = at, r = rx, k = first; j < at + added; j++)
+    {
+        r = editorRenderChars(&row->chars[j], 1, r, nullptr);
+        if (row->chars[j] == '\t')
+        {
+            row->tabs[k].cx = j;
+            row->tabs[k++].rx = r;
+        }
+    }
+
+    editorUpdateSyntaxAt(row, rx, oldend - rx, newend - rx);
+}
+
+// Bring a row up to date after chars [at, at + added) replaced the
+// `nremoved` chars in `removed`. The gap must sit right after the new chars.
+void editorUpdateRowAt(erow *row, int at, int added, const char *removed, int nremoved)
+{
+    if ((row->chunks || row->compact) && memchr(&row->chars[at], '\t', added))
+    {
+        // A tab gives the row a render of its own again
+        editorUpdateRow(row);
+        return;
+    }
+    if (row->chunks)
+    {
+        editorChunkEdit(row, at, added, nremoved);
+    }
+    else if (row->compact)
+    {
+        row->rsize = row->size;
+        editorUpdateSyntax(row);
+    }
+    else
+    {
+        editorRenderRowAt(row, at, added, removed, nremoved);
+    }
+
+    // Add the trigrams the edit formed; the ones it broke stay, which only
+    // lets a search look at this row for nothing
+    const char *after = &row->chars[row->cap - 1 - row->size + row->gap];
+    uint32_t t = 0;
+    int n = 0;
+    int from = at < 2 ? 0 : at - 2;
+    row->tri |= editorTrigramSign(&row->chars[from], row->gap - from, &t, &n);
+    row->tri |= editorTrigramSign(after, row->size - row->gap < 2 ? row->size - row->gap : 2, &t, &n);
+}
+
+// Text of row `at` without loading it; `len` receives its size
+const char *editorRowText(int at, int *len)
+{
+    int k;
+    rowNode *n = editorNodeFind(at, &k);
+    return editorNodeText(n, k, len);
+}
+
+// Size of row `at`, without loading it
+int editorRowSize(int at)
+{
+    int k;
+    rowNode *n = editorNodeFind(at, &k);
+    if (n->line < 0)
+        return n->row.size;
+    int len;
+    editorMapLine(n->line + k, &len);
+    return len;
+}
+
+int editorRowIsLoaded(int at)
+{
+    int k;
+    return editorNodeFind(at, &k)->line < 0;
+}
+
+// Copy a mapped line into its row the first time the row is needed
+void editorLoadRow(int at)
+{
+    int k;
+    rowNode *n = editorNodeFind(at, &k);
+    size_t line = n->line + k;
+    // The comment state entering the row comes from the lines above it in
+    // its run, which are followed through the mapping without loading them
+    int in_comment = 0;
+    int out_comment = 0;
+    if (E.syntax)
+    {
+        editorSyntaxResolve(at - k - 1);
+        in_comment = editorSyntaxMapState(n->line, line, editorSyntaxEntry(n));
+        out_comment = editorSyntaxLinesState(line, line + 1, in_comment);
+    }
+
+    int stale = n->row.hl_stale;
+    rowNode *m = editorNodeRemove(at);
+    int len;
+    const char *s = editorNodeText(m, 0, &len);
+
+    erow *row = &m->row;
+    editorRowInitChars(row, s, len);
+    row->rsize = 0;
+    row->render = nullptr;
+    row->hl = nullptr;
+    row->rcap = 0;
+    row->hl_cp = nullptr;
+    row->hl_ncp = 0;
+    row->tabs = nullptr;
+    row->ntabs = 0;
+    row->tabcap = 0;
+    row->chunks = nullptr;
+    row->nchunks = 0;
+    row->compact = 0;
+    row->nspans = 0;
+    // What the rows below were already worked out from
+    row->hl_open_comment = out_comment;
+    row->hl_stale = 0;
+    m->line = -1;
+    m->mapped = line;
+    E.loaded++;
+
+    editorNodeInsert(at, m);
+    if (k > 0)
+    {
+        erow *head = &editorNodePrev(m)->row;
+        head->hl_open_comment = in_comment;
+        editorSyntaxSetStale(head, 0);
+    }
+    editorUpdateRow(row);
+    // Whatever follows was worked out from a state that was already stale
+    rowNode *next = editorNodeNext(m);
+    if (stale && next)
+        editorSyntaxSetStale(&next->row, 1);
+}
+
+// Return row `at`, loading it from the mapped file if needed
+erow *editorRowAt(int at)
+{
+    int k;
+    rowNode *n = editorNodeFind(at, &k);
+    if (n->line < 0)
+        return &n->row;
+    editorLoadRow(at);
+    return &editorNodeFind(at, &k)->row;
+}
+
+void editorRowInsertChar(erow *row, int at, char c)
+{
+    // Ensure 'at' is within bounds
+    if (at < 0 || at > row->size)
+        at = row->size;
+
+    // Typing fills the gap in place; only the edited stretch is rendered again
+    editorRowMoveGap(row, at, 1);
+    row->chars[row->gap++] = c;
+    row->size++;
+
+    editorUpdateRowAt(row, at, 1, nullptr, 0);
+    editorFindRowChanged(row);
+    int y = editorNodeIndex((rowNode *)row);
+    editorJournalRecord(J_INSERT, y, at, &c, 1);
+    editorUndoRecord(UNDO_INSERT, y, at, &c, 1);
+    E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len)
+{
+    if (at < 0 || at > row->size)
+        at = row->size;
+
+    editorRowMoveGap(row, at, len);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->size += len;
+
+    editorUpdateRowAt(row, at, len, nullptr, 0);
+    editorFindRowChanged(row);
+    int y = editorNodeIndex((rowNode *)row);
+    editorJournalRecord(J_INSERT, y, at, s, len);
+    editorUndoRecord(UNDO_INSERT, y, at, s, len);
+    E.dirty++;
+}
+
+// Delete `len` chars from `at` on
+void editorRowDeleteString(erow *row, int at, int len)
+{
+    if (at < 0 || len <= 0 || at + len > row->size)
+        return;
+
+    // The deleted chars stay in the gap long enough to be rendered out
+    editorRowMoveGap(row, at + len, 0);
+    row->gap -= len;
+    row->size -= len;
+    const char *removed = &row->chars[at];
+
+    editorUpdateRowAt(row, at, 0, removed, len);
+    editorFindRowChanged(row);
+    int y = editorNodeIndex((rowNode *)row);
+    editorJournalRecord(J_DELETE, y, at, removed, len);
+    editorUndoRecord(UNDO_DELETE, y, at, removed, len);
+    E.dirty++;
+}
+
+// Insert a new row into the editor's row tree
+void editorInsertRow(int at, const char *s, size_t len)
+{
+    if (at < 0 || at > E.numrows)
+        return;
+
+    rowNode *n = editorNewNode(-1, 1);
+    erow *row = &n->row;
+    editorRowInitChars(row, s, len);
+
+    row->rsize = 0;
+    row->render = nullptr;
+    row->hl = nullptr;
+    // Forces the next row to be checked against whatever this row leaves open
+    row->hl_open_comment = -1;
+
+    editorNodeInsert(at, n);
+    editorUpdateRow(row);
+    E.numrows++;
+    editorFindRowInserted(at);
+    editorJournalRecord(J_INSERT_ROW, at, 0, s, len);
+    char *list = editorUndoRecord(UNDO_INSERT_ROWS, at, 1, nullptr, sizeof(uint32_t) + len);
+    if (list)
+        editorRowListPut(list, s, len);
+    E.dirty++;
+}
+
+// Insert the `count` rows of a row list as one run at `at`. The rows are
+// highlighted once they are needed, so this costs only the bytes copied.
+void editorInsertRows(int at, int count, const char *list, size_t len)
+{
+    if (at < 0 || at > E.numrows || count <= 0)
+        return;
+
+    rowNode *run = nullptr;
+    const char *p = list;
+    for (int j = 0; j < count; j++)
+    {
+        uint32_t size;
+        memcpy(&size, p, sizeof(size));
+        p += sizeof(size);
+
+        rowNode *n = editorNewNode(-1, 1);
+        erow *r = &n->row;
+        editorRowInitChars(r, p, size);
+        editorRenderRow(r);
+        r->hl_open_comment = -1;
+        r->hl_stale = 1;
+        editorNodeUpdate(n);
+        run = editorNodeMerge(run, n);
+        p += size;
+    }
+
+    editorNodeInsert(at, run);
+    E.numrows += count;
+    editorFindRowsInserted(at, count);
+    editorJournalRecord(J_INSERT_ROWS, at, count, list, len);
+    editorUndoRecord(UNDO_INSERT_ROWS, at, count, list, len);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at)
+{
+    if (at < 0 || at >= row->size)
+        return;
+
+    char c = editorRowChar(row, at);
+    editorRowMoveGap(row, at + 1, 0);
+    row->gap--;
+    row->size--;
+
+    editorUpdateRowAt(row, at, 0, &c, 1);
+    editorFindRowChanged(row);
+    int y = editorNodeIndex((rowNode *)row);
+    editorJournalRecord(J_DELETE_CHAR, y, at, nullptr, 0);
+    editorUndoRecord(UNDO_DELETE, y, at, &c, 1);
+    E.dirty++;
+}
+
+// Cut the row off after `len` chars
+void editorRowTruncate(erow *row, int len)
+{
+    if (len < 0 || len > row->size)
+        return;
+    editorRowCloseGap(row);
+    int y = editorNodeIndex((rowNode *)row);
+    editorUndoRecord(UNDO_DELETE, y, len, &row->chars[len], row->size - len);
+    row->size = len;
+    row->gap = row->size;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    editorFindRowChanged(row);
+    editorJournalRecord(J_TRUNCATE, y, len, nullptr, 0);
+    E.dirty++;
+}
+
+void editorFreeRow(erow *row)
+{
+    if (E.gaprow == row)
+        E.gaprow = nullptr;
+    free(row->hl_cp);
+    editorSlabFree(row->tabs, sizeof(rowTab) * row->tabcap);
+    editorRowFreeChunks(row);
+    editorSlabFree(row->render, 2 * row->rcap);
+    if (row->chars != row->inl)
+        editorSlabFree(row->chars, row->cap);
+}
+
+void editorDelRow(int at)
+{
+    if (at < 0 || at >= E.numrows)
+        return;
+
+    int len;
+    const char *s = editorRowText(at, &len);
+    char *list = editorUndoRecord(UNDO_DELETE_ROWS, at, 1, nullptr, sizeof(uint32_t) + len);
+    if (list)
+        editorRowListPut(list, s, len);
+
+    rowNode *n = editorNodeRemove(at);
+    if (n->line < 0)
+        editorFreeRow(&n->row);
+    if (n->mapped >= 0)
+        E.loaded--;
+    editorSlabFree(n, editorSlabSize(sizeof(rowNode)));
+
+    // The row that moved up now follows a different comment state
+    if (at < E.numrows - 1)
+    {
+        int k;
+        editorSyntaxSetStale(&editorNodeFind(at, &k)->row, 1);
+    }
+
+    E.numrows--;
+    editorFindRowDeleted(at);
+    editorJournalRecord(J_DELETE_ROW, at, 0, nullptr, 0);
+    E.dirty++;
+}
+
+void editorFreeNodes(rowNode *n)
+{
+    if (!n)
+        return;
+    editorFreeNodes(n->left);
+    editorFreeNodes(n->right);
+    if (n->line < 0)
+        editorFreeRow(&n->row);
+    if (n->mapped >= 0)
+        E.loaded--;
+    editorSlabFree(n, editorSlabSize(sizeof(rowNode)));
+}
+
+// Make loaded row `n` a run of the one mapped line it still matches. The
+// comment state it leaves stays, having been worked out from the same text.
+void editorUnloadRow(rowNode *n)
+{
+    signed char open = n->row.hl_open_comment;
+    unsigned char stale = n->row.hl_stale;
+    editorFreeRow(&n->row);
+    memset(&n->row, 0, sizeof(erow));
+    n->row.hl_open_comment = open;
+    n->row.hl_stale = stale;
+    n->line = n->mapped;
+    n->mapped = -1;
+    E.loaded--;
+}
+
+// Add run `n`, the rows from `at` on, to the end of run `prev` before it,
+// whose mapped lines it goes on from
+void editorNodeJoin(rowNode *prev, rowNode *n, int at)
+{
+    rowNode *a, *b, *m, *c;
+    editorNodeSplit(E.rows, at, &a, &b);
+    editorNodeSplit(b, n->lines, &m, &c);
+    E.rows = editorNodeMerge(a, c);
+    E.rows->parent = nullptr;
+    prev->lines += n->lines;
+    prev->row.hl_open_comment = n->row.hl_open_comment;
+    prev->row.hl_stale |= n->row.hl_stale;
+    editorNodeRefresh(prev);
+    editorSlabFree(n, editorSlabSize(sizeof(rowNode)));
+}
+
+// Once more than EDILITE_LOADED_MAX rows read from the mapping have been
+// loaded since the last time, put the ones still matching their line back
+// into runs, each row then costing no more than its line offset. Rows
+// within a screen of the one shown stay, as does the cursor's.
+void editorUnloadRows()
+{
+    if (!E.map || E.loaded - E.loadedkept <= EDILITE_LOADED_MAX || editorFindPending())
+        return;
+    int lo = E.rowoff - E.screenrows;
+    int hi = E.rowoff + 2 * E.screenrows + EDILITE_HL_LOOKAHEAD;
+    E.loadedkept = 0;
+    int at = 0;
+    rowNode *prev = nullptr;
+    for (rowNode *n = editorNodeFirst(), *next; n; n = next)
+    {
+        next = editorNodeNext(n);
+        if (n->line < 0 && n->mapped >= 0)
+        {
+            if ((at >= lo && at < hi) || at == E.cy || &n->row == E.gaprow)
+            {
+                E.loadedkept++;
+            }
+            else
+            {
+                int len, maplen;
+                const char *s = editorNodeText(n, 0, &len);
+                const char *line = editorMapLine(n->mapped, &maplen);
+                if (len == maplen && !memcmp(s, line, len))
+                {
+                    editorUnloadRow(n);
+                }
+                else
+                {
+                    n->mapped = -1; // Edited
+                    E.loaded--;
+                }
+            }
+        }
+        int lines = n->lines;
+        if (n->line >= 0 && prev && prev->line >= 0 && prev->line + prev->lines == n->line)
+            editorNodeJoin(prev, n, at);
+        else
+            prev = n;
+        at += lines;
+    }
+}
+
+// Delete `count` rows from `at` on, cutting them out of the tree as one
+// subtree
+void editorDelRows(int at, int count)
+{
+    if (at < 0 || count <= 0 || at + count > E.numrows)
+        return;
+
+    rowNode *a, *b, *m, *c;
+    editorNodeSplit(E.rows, at, &a, &b);
+    editorNodeSplit(b, count, &m, &c);
+    E.rows = editorNodeMerge(a, c);
+    if (E.rows)
+        E.rows->parent = nullptr;
+    m->parent = nullptr;
+
+    rowNode *first = m;
+    while (first->left)
+        first = first->left;
+    size_t size = 0;
+    for (rowNode *n = first; n; n = editorNodeNext(n))
+    {
+        for (int k = 0; k < n->lines; k++)
+        {
+            int len;
+            editorNodeText(n, k, &len);
+            size += sizeof(uint32_t) + len;
+        }
+    }
+    char *list = editorUndoRecord(UNDO_DELETE_ROWS, at, count, nullptr, size);
+    for (rowNode *n = first; list && n; n = editorNodeNext(n))
+    {
+        for (int k = 0; k < n->lines; k++)
+        {
+            int len;
+            const char *s = editorNodeText(n, k, &len);
+            list = editorRowListPut(list, s, len);
+        }
+    }
+    editorFreeNodes(m);
+
+    if (at < E.numrows - count)
+    {
+        int k;
+        editorSyntaxSetStale(&editorNodeFind(at, &k)->row, 1);
+    }
+
+    E.numrows -= count;
+    editorFindRowsDeleted(at, count);
+    editorJournalRecord(J_DELETE_ROWS, at, count, nullptr, 0);
+    E.dirty++;
+}
+
+void editorRowAppendString(erow *row, const char *s, size_t len)
+{
+    editorRowCloseGap(row);
+    if (row->size + (int)len + 1 > row->cap)
+        editorRowGrowChars(row, row->size + len + 1);
+    std::memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->gap = row->size;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    editorFindRowChanged(row);
+    int y = editorNodeIndex((rowNode *)row);
+    editorJournalRecord(J_INSERT, y, row->size - len, s, len);
+    editorUndoRecord(UNDO_INSERT, y, row->size - len, s, len);
+    E.dirty++;
+}
+
+/*** editor operations ***/
+void editorInsertChar(int c)
+{
+    if (E.cy == E.numrows)
+    {
+        editorInsertRow(E.numrows, "", 0); // Append a new empty row if needed
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorDelChar()
+{
+    if (E.cy == E.numrows)
+        return;
+
+    if (E.cx == 0 && E.cy == 0)
+        return;
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > 0)
+    {
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    }
+    else
+    {
+        erow *prev = editorRowAt(E.cy - 1);
+        editorRowCloseGap(row);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+// Apply an undo op, or its reverse
+void editorUndoApply(const undoOp *op, bool reverse)
+{
+    const char *s = editorUndoData(op->pos);
+    bool insert = (op->type == UNDO_INSERT || op->type == UNDO_INSERT_ROWS) != reverse;
+    if (op->type == UNDO_INSERT || op->type == UNDO_DELETE)
+    {
+        erow *row = editorRowAt(op->row);
+        if (insert)
+            editorRowInsertString(row, op->arg, s, op->len);
+        else
+            editorRowDeleteString(row, op->arg, op->len);
+    }
+    else if (insert)
+    {
+        editorInsertRows(op->row, op->arg, s, op->len);
+    }
+    else
+    {
+        editorDelRows(op->row, op->arg);
+    }
+}
+
+// Reverse the last group of edits: one step costs the bytes it changed
+void editorUndo()
+{
+    undoLog *u = &E.undo;
+    if (u->done == 0)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    undoGroup g = u->groups[u->done - 1];
+    size_t end = u->done < u->groups.size() ? u->groups[u->done].first : u->opbase + u->ops.size();
+    u->applying = true;
+    for (size_t j = end; j-- > g.first;)
+        editorUndoApply(&u->ops[j - u->opbase], true);
+    u->applying = false;
+    u->done--;
+    u->open = false;
+    E.cy = g.cy;
+    E.cx = g.cx;
+}
+
+void editorRedo()
+{
+    undoLog *u = &E.undo;
+    if (u->done == u->groups.size())
+    {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    undoGroup g = u->groups[u->done];
+    size_t end = u->done + 1 < u->groups.size() ? u->groups[u->done + 1].first : u->opbase + u->ops.size();
+    u->applying = true;
+    for (size_t j = g.first; j < end; j++)
+        editorUndoApply(&u->ops[j - u->opbase], false);
+    u->applying = false;
+    u->done++;
+    E.cy = g.ecy;
+    E.cx = g.ecx;
+}
+
+void editorInsertNewline()
+{
+    if (E.cy == E.numrows)
+    {
+        editorInsertRow(E.numrows, "", 0); // Insert an empty row if at the end of file
+    }
+    else if (E.cx == 0)
+    {
+        editorInsertRow(E.cy, "", 0);
+    }
+    else
+    {
+        erow *row = editorRowAt(E.cy);
+        editorRowCloseGap(row);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+
+        editorRowTruncate(editorRowAt(E.cy), E.cx);
+    }
+
+    // Move cursor to the beginning of the new row
+    E.cy++;
+    E.cx = 0;
+    E.dirty++;
+}
+
+// Insert a block of text at the cursor, as a paste does. Its lines are cut
+// out once and go into the row tree as one run; they are highlighted later,
+// when drawn, as any other stale row is.
+void editorInsertText(const char *s, size_t len)
+{
+    if (E.cy == E.numrows)
+        editorInsertRow(E.numrows, "", 0);
+
+    // A line break is \r, \n or \r\n
+    size_t eol = 0;
+    while (eol < len && s[eol] != '\r' && s[eol] != '\n')
+        eol++;
+    erow *row = editorRowAt(E.cy);
+    if (eol == len)
+    {
+        editorRowInsertString(row, E.cx, s, len);
+        E.cx += len;
+        return;
+    }
+
+    // The first line ends the cursor row; what followed the cursor goes
+    // after the last line
+    editorRowCloseGap(row);
+    std::string tail(&row->chars[E.cx], row->size - E.cx);
+    editorRowTruncate(row, E.cx);
+    editorRowAppendString(row, s, eol);
+
+    // The other lines go in as one run of rows
+    std::string list;
+    int count = 0;
+    int lastlen = 0;
+    size_t from = eol;
+    while (from < len)
+    {
+        from += (s[from] == '\r' && from + 1 < len && s[from + 1] == '\n') ? 2 : 1;
+        size_t end = from;
+        while (end < len && s[end] != '\r' && s[end] != '\n')
+            end++;
+        int size = end - from;
+        int extra = end == len ? tail.size() : 0;
+        uint32_t n = size + extra;
+        list.append((const char *)&n, sizeof(n));
+        list.append(&s[from], size);
+        list.append(tail.data(), extra);
+        count++;
+        lastlen = size;
+        from = end;
+    }
+
+    editorInsertRows(E.cy + 1, count, list.data(), list.size());
+    E.cy += count;
+    E.cx = lastlen;
+}
+
+/*** file i/o ***/
+// Map a regular file and index where each line starts. Rows stay unloaded
+// until they are drawn or edited, so opening costs one pass of memchr().
+bool editorMapFile(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const char *start = (const char *)map;
+    const char *end = start + st.st_size;
+    size_t cap = 1024;
+    size_t n = 0;
+    size_t *lineoff = (size_t *)malloc(sizeof(size_t) * cap);
+
+    const char *p = start;
+    while (p < end)
+    {
+        if (n + 2 > cap)
+        {
+            cap *= 2;
+            lineoff = (size_t *)realloc(lineoff, sizeof(size_t) * cap);
+        }
+        lineoff[n++] = p - start;
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+    lineoff[n] = st.st_size;
+
+    E.map = start;
+    E.mapsize = st.st_size;
+    E.lineoff = lineoff;
+    E.maplines = n;
+    E.hlblock = new std::atomic<unsigned char>[n / EDILITE_HL_BLOCK + 1]();
+    E.rows = editorNewNode(0, n); // One run holding every line
+    E.numrows = n;
+    return true;
+}
+
+void editorUnmapFile()
+{
+    editorStopHighlighter();
+    editorStopTrigrams();
+    if (E.map)
+        munmap((void *)E.map, E.mapsize);
+    free(E.lineoff);
+    delete[] E.hlblock;
+    E.map = nullptr;
+    E.mapsize = 0;
+    E.lineoff = nullptr;
+    E.maplines = 0;
+    E.hlblock = nullptr;
+    // Loaded rows have no line to go back to now
+    for (rowNode *n = editorNodeFirst(); n; n = editorNodeNext(n))
+        n->mapped = -1;
+    E.loaded = E.loadedkept = 0;
+}
+
+// Where each row starts in the file a save writes
+size_t *editorRowOffsets()
+{
+    size_t *lineoff = (size_t *)malloc(sizeof(size_t) * (E.numrows + 1));
+    size_t off = 0;
+    int j = 0;
+    for (rowNode *n = editorNodeFirst(); n; n = editorNodeNext(n))
+    {
+        for (int k = 0; k < n->lines; k++)
+        {
+            int len;
+            editorNodeText(n, k, &len);
+            lineoff[j++] = off;
+            off += len + 1;
+        }
+    }
+    lineoff[E.numrows] = off;
+    return lineoff;
+}
+
+// After a save the file holds the rows laid out as `lineoff`, so map it
+// and point unloaded rows at their new offsets. The old mapping stays
+// readable until then: a rename leaves the old file alive while mapped.
+void editorRemapFile(size_t *lineoff)
+{
+    // Text still to be searched lies in the old mapping
+    if (editorFindPending())
+        editorFindClear();
+    size_t off = lineoff[E.numrows];
+    int fd = open(E.filename, O_RDONLY);
+    void *map = MAP_FAILED;
+    if (fd != -1)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size == off && off > 0)
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+    }
+
+    if (map == MAP_FAILED)
+    {
+        // Could not map the new file: load the remaining rows from the old one
+        for (int j = 0; j < E.numrows; j++)
+        {
+            if (!editorRowIsLoaded(j))
+                editorLoadRow(j);
+        }
+        editorUnmapFile();
+        free(lineoff);
+        return;
+    }
+    editorUnmapFile();
+
+    // Every row now sits at its own line of the new file, so loaded ones
+    // can be unloaded again
+    int at = 0;
+    for (rowNode *n = editorNodeFirst(); n; n = editorNodeNext(n))
+    {
+        if (n->line >= 0)
+        {
+            n->line = at;
+        }
+        else
+        {
+            n->mapped = at;
+            E.loaded++;
+        }
+        at += n->lines;
+    }
+
+    E.map = (const char *)map;
+    E.mapsize = off;
+    E.lineoff = lineoff;
+    E.maplines = E.numrows;
+    E.hlblock = new std::atomic<unsigned char>[E.numrows / EDILITE_HL_BLOCK + 1]();
+    editorStartHighlighter();
+    editorStartTrigrams();
+}
+
+// Write all of `iov`, picking up again after a short write
+bool editorWriteAll(int fd, struct iovec *iov, int n)
+{
+    while (n > 0)
+    {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len)
+        {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+// Stream every row, each ended by a newline, straight from where it is
+// kept. Mapped lines already followed by "\n" are written with it, so a run
+// of untouched lines goes out as one piece. `written` receives the size.
+bool editorWriteRows(int fd, size_t *written)
+{
+    static const char newline = '\n';
+    struct iovec iov[EDILITE_SAVE_IOV];
+    int niov = 0;
+    *written = 0;
+    for (rowNode *n = editorNodeFirst(); n; n = editorNodeNext(n))
+    {
+        for (int k = 0; k < n->lines; k++)
+        {
+            int len;
+            const char *s = editorNodeText(n, k, &len);
+            bool mapped_nl = n->line >= 0 && s + len < E.map + E.mapsize && s[len] == '\n';
+            size_t size = len + (mapped_nl ? 1 : 0);
+            *written += len + 1;
+
+            for (int piece = 0; piece < 2; piece++)
+            {
+                if (piece == 1)
+                {
+                    if (mapped_nl)
+                        break;
+                    s = &newline;
+                    size = 1;
+                }
+                if (size == 0)
+                    continue;
+                if (niov > 0 && (const char *)iov[niov - 1].iov_base + iov[niov - 1].iov_len == s)
+                {
+                    iov[niov - 1].iov_len += size;
+                    continue;
+                }
+                if (niov == EDILITE_SAVE_IOV)
+                {
+                    if (!editorWriteAll(fd, iov, niov))
+                        return false;
+                    niov = 0;
+                }
+                iov[niov].iov_base = (void *)s;
+                iov[niov].iov_len = size;
+                niov++;
+            }
+        }
+    }
+    return editorWriteAll(fd, iov, niov);
+}
+
+// Remove a temporary file that could not be finished, keeping errno
+bool editorDropTemp(char *tmp)
+{
+    int saved = errno;
+    unlink(tmp);
+    free(tmp);
+    errno = saved;
+    return false;
+}
+
+// Write the rows to a temporary file next to `path`, with its permissions,
+// flush it to disk and rename it over `path`, so a crash leaves either the
+// old file or the new one. Returns false with errno set on failure.
+bool editorWriteFile(const char *path, size_t *written)
+{
+    char *tmp = (char *)malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+    {
+        free(tmp);
+        return false;
+    }
+
+    struct stat st;
+    bool ok;
+    if (stat(path, &st) == 0)
+    {
+        ok = fchmod(fd, st.st_mode & 07777) == 0;
+        // Keeping the owner is not always allowed; the file is saved anyway
+        (void)!fchown(fd, st.st_uid, st.st_gid);
+    }
+    else
+    {
+        mode_t mask = umask(0);
+        umask(mask);
+        ok = fchmod(fd, 0666 & ~mask) == 0;
+    }
+
+    if (!ok || !editorWriteRows(fd, written) || fsync(fd) == -1)
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return editorDropTemp(tmp);
+    }
+    if (close(fd) == -1 || rename(tmp, path) == -1)
+        return editorDropTemp(tmp);
+
+    // Make the rename itself durable
+    int dfd = open(dirname(tmp), O_RDONLY);
+    if (dfd != -1)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(tmp);
+    return true;
+}
+
+void editorSave()
+{
+    EDILITE_PROBE(PROBE_SAVE);
+    if (E.filename == nullptr)
+    {
+        E.filename = strdup(editorPrompt("Save as: %s (ESC to cancel)", NULL).c_str());
+        if (E.filename == nullptr || E.filename[0] == '\0')
+        { // Check for cancel
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    if (E.gaprow)
+        editorRowCloseGap(E.gaprow);
+
+    // A symlink is followed, so the file it points at is the one replaced
+    char *path = realpath(E.filename, nullptr);
+    size_t len;
+    bool ok = editorWriteFile(path ? path : E.filename, &len);
+    free(path);
+    if (ok)
+    {
+        if (E.map)
+            editorRemapFile(editorRowOffsets());
+        editorJournalReset();
+        E.dirty = 0;
+        editorSetStatusMessage("%zu bytes written to disk... File saved successfully", len);
+    }
+    else
+    {
+        editorSetStatusMessage("Can't save! %s", strerror(errno));
+    }
+}
+
+/*** regex ***/
+// Regex search understands literals, `.`, `[...]` and `[^...]` with ranges,
+// `\d \w \s` and their negations, `^ $`, `( )`, `|`, and `* + ? {m} {m,}
+// {m,n}`. Matches are leftmost-longest and never cross a line.
+enum reKind
+{
+    RE_N_SET,
+    RE_N_CAT,
+    RE_N_ALT,
+    RE_N_REP,
+    RE_N_BOL,
+    RE_N_EOL,
+    RE_N_EMPTY
+};
+
+struct reNode
+{
+    int kind;
+    int a;   // First child
+    int b;   // Second child
+    int min; // Repeat bounds, max -1 for no limit
+    int max;
+    int set; // Byte set of RE_N_SET
+};
+
+struct reParser
+{
+    const char *p;
+    const char *end;
+    std::vector<reNode> nodes;
+    reRegex *re;
+    const char *error;
+};
+
+int editorRegexNode(reParser *ps, int kind, int a, int b)
+{
+    reNode n = {kind, a, b, 0, 0, 0};
+    ps->nodes.push_back(n);
+    return ps->nodes.size() - 1;
+}
+
+int editorRegexSet(reParser *ps, const std::bitset<256> &set)
+{
+    ps->re->sets.push_back(set);
+    int n = editorRegexNode(ps, RE_N_SET, -1, -1);
+    ps->nodes[n].set = ps->re->sets.size() - 1;
+    return n;
+}
+
+// Bytes matched by `\c`: a class, or the character itself
+std::bitset<256> editorRegexEscape(char c)
+{
+    std::bitset<256> set;
+    switch (c)
+    {
+    case 'd':
+    case 'D':
+        for (int j = '0'; j <= '9'; j++)
+            set.set(j);
+        break;
+    case 'w':
+    case 'W':
+        for (int j = 0; j < 256; j++)
+            if (isalnum(j) || j == '_')
+                set.set(j);
+        break;
+    case 's':
+    case 'S':
+        for (int j = 0; j < 256; j++)
+            if (isspace(j))
+                set.set(j);
+        break;
+    case 't':
+        set.set('\t');
+        return set;
+    default:
+        set.set((unsigned char)c);
+        return set;
+    }
+    if (isupper(c))
+        set.flip();
+    return set;
+}
+
+// Parse `{m}`, `{m,}` or `{m,n}`; anything else leaves the `{` as a literal
+bool editorRegexBounds(reParser *ps, int *min, int *max)
+{
+    const char *q = ps->p + 1;
+    auto number = [&](int *v)
+    {
+        if (q == ps->end || !isdigit(*q))
+            return false;
+        *v = 0;
+        for (; q < ps->end && isdigit(*q); q++)
+            if (*v <= 100000)
+                *v = *v * 10 + (*q - '0');
+        return true;
+    };
+    if (!number(min))
+        return false;
+    *max = *min;
+    if (q < ps->end && *q == ',')
+    {
+        q++;
+        if (!number(max))
+            *max = -1;
+    }
+    if (q == ps->end || *q != '}')
+        return false;
+    if (*min > 1000 || *max > 1000 || (*max >= 0 && *max < *min))
+        ps->error = "bad repeat";
+    ps->p = q + 1;
+    return true;
+}
+
+int editorRegexAlt(reParser *ps);
+
+int editorRegexAtom(reParser *ps)
+{
+    char c = *ps->p++;
+    std::bitset<256> set;
+    switch (c)
+    {
+    case '(':
+    {
+        int n = editorRegexAlt(ps);
+        if (n < 0)
+            return -1;
+        if (ps->p == ps->end || *ps->p != ')')
+        {
+            ps->error = "missing )";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    }
+    case '^':
+        return editorRegexNode(ps, RE_N_BOL, -1, -1);
+    case '$':
+        return editorRegexNode(ps, RE_N_EOL, -1, -1);
+    case '.':
+        set.set();
+        return editorRegexSet(ps, set);
+    case '*':
+    case '+':
+    case '?':
+        ps->error = "nothing to repeat";
+        return -1;
+    case '\\':
+        if (ps->p == ps->end)
+        {
+            ps->error = "trailing \\";
+            return -1;
+        }
+        return editorRegexSet(ps, editorRegexEscape(*ps->p++));
+    case '[':
+    {
+        bool negate = ps->p < ps->end && *ps->p == '^';
+        if (negate)
+            ps->p++;
+        // A `]` right after the opening bracket is a member
+        for (bool first = true; ps->p < ps->end && (*ps->p != ']' || first); first = false)
+        {
+            unsigned char lo = *ps->p++;
+            if (lo == '\\' && ps->p < ps->end)
+            {
+                set |= editorRegexEscape(*ps->p++);
+                continue;
+            }
+            unsigned char hi = lo;
+            if (ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']')
+            {
+                hi = ps->p[1];
+                ps->p += 2;
+            }
+            if (hi < lo)
+            {
+                ps->error = "bad range";
+                return -1;
+            }
+            for (int j = lo; j <= hi; j++)
+                set.set(j);
+        }
+        if (ps->p == ps->end)
+        {
+            ps->error = "missing ]";
+            return -1;
+        }
+        ps->p++;
+        if (negate)
+            set.flip();
+        return editorRegexSet(ps, set);
+    }
+    default:
+        set.set((unsigned char)c);
+        return editorRegexSet(ps, set);
+    }
+}
+
+int editorRegexRepeat(reParser *ps)
+{
+    int n = editorRegexAtom(ps);
+    while (n >= 0 && ps->p < ps->end)
+    {
+        int min, max;
+        if (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')
+        {
+            min = (*ps->p == '+');
+            max = (*ps->p == '?') ? 1 : -1;
+            ps->p++;
+        }
+        else if (*ps->p != '{' || !editorRegexBounds(ps, &min, &max))
+            break;
+        int r = editorRegexNode(ps, RE_N_REP, n, -1);
+        ps->nodes[r].min = min;
+        ps->nodes[r].max = max;
+        n = r;
+    }
+    return n;
+}
+
+int editorRegexCat(reParser *ps)
+{
+    int n = editorRegexNode(ps, RE_N_EMPTY, -1, -1);
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')' && !ps->error)
+    {
+        int r = editorRegexRepeat(ps);
+        if (r < 0)
+            return -1;
+        n = editorRegexNode(ps, RE_N_CAT, n, r);
+    }
+    return n;
+}
+
+int editorRegexAlt(reParser *ps)
+{
+    int n = editorRegexCat(ps);
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|')
+    {
+        ps->p++;
+        int r = editorRegexCat(ps);
+        if (r < 0)
+            return -1;
+        n = editorRegexNode(ps, RE_N_ALT, n, r);
+    }
+    return n;
+}
+
+// Append the program for node `n`; `reverse` emits the pattern back to front
+void editorRegexEmit(reParser *ps, int n, bool reverse, std::vector<reInst> *code)
+{
+    if (code->size() > EDILITE_RE_INSTS)
+    {
+        ps->error = "pattern too large";
+        return;
+    }
+    reNode nd = ps->nodes[n];
+    reInst in = {RE_SET, nd.set, 0};
+    switch (nd.kind)
+    {
+    case RE_N_SET:
+        code->push_back(in);
+        break;
+    case RE_N_BOL:
+    case RE_N_EOL:
+        in.op = (nd.kind == RE_N_BOL) != reverse ? RE_BOL : RE_EOL;
+        code->push_back(in);
+        break;
+    case RE_N_CAT:
+        editorRegexEmit(ps, reverse ? nd.b : nd.a, reverse, code);
+        editorRegexEmit(ps, reverse ? nd.a : nd.b, reverse, code);
+        break;
+    case RE_N_ALT:
+    {
+        int split = code->size();
+        in.op = RE_SPLIT;
+        in.x = split + 1;
+        code->push_back(in);
+        editorRegexEmit(ps, nd.a, reverse, code);
+        int jmp = code->size();
+        in.op = RE_JMP;
+        code->push_back(in);
+        (*code)[split].y = code->size();
+        editorRegexEmit(ps, nd.b, reverse, code);
+        (*code)[jmp].x = code->size();
+        break;
+    }
+    case RE_N_REP:
+    {
+        for (int j = 0; j < nd.min; j++)
+            editorRegexEmit(ps, nd.a, reverse, code);
+        // Each optional copy may be skipped to the end
+        std::vector<int> splits;
+        for (int j = nd.min; j < nd.max || (nd.max < 0 && j == nd.min); j++)
+        {
+            splits.push_back(code->size());
+            in.op = RE_SPLIT;
+            in.x = code->size() + 1;
+            code->push_back(in);
+            editorRegexEmit(ps, nd.a, reverse, code);
+            if (nd.max < 0)
+            {
+                in.op = RE_JMP;
+                in.x = splits.back();
+                code->push_back(in);
+            }
+        }
+        for (int split : splits)
+            (*code)[split].y = code->size();
+        break;
+    }
+    }
+}
+
+// Longest run of single bytes every match of node `n` contains in a row
+void editorRegexLiteral(const reParser *ps, int n, std::string *run, std::string *best)
+{
+    const reNode &nd = ps->nodes[n];
+    if (nd.kind == RE_N_CAT)
+    {
+        editorRegexLiteral(ps, nd.a, run, best);
+        editorRegexLiteral(ps, nd.b, run, best);
+        return;
+    }
+    if (nd.kind == RE_N_EMPTY || nd.kind == RE_N_BOL || nd.kind == RE_N_EOL)
+        return; // Take up no bytes
+    const std::bitset<256> *set = nd.kind == RE_N_SET ? &ps->re->sets[nd.set] : nullptr;
+    if (set && set->count() == 1)
+    {
+        for (int j = 0; j < 256; j++)
+            if (set->test(j))
+                *run += (char)j;
+        return;
+    }
+    if (run->size() > best->size())
+        *best = *run;
+    run->clear();
+}
+
+// Compile `pattern`, or return null with the reason in `error`
+reRegex *editorRegexCompile(const std::string &pattern, const char **error)
+{
+    reRegex *re = new reRegex();
+    reParser ps = {pattern.data(), pattern.data() + pattern.size(), std::vector<reNode>(), re, nullptr};
+    int root = editorRegexAlt(&ps);
+    if (!ps.error && ps.p != ps.end)
+        ps.error = "unmatched )";
+    reInst match = {RE_MATCH, 0, 0};
+    if (!ps.error)
+    {
+        editorRegexEmit(&ps, root, false, &re->fwd);
+        re->fwd.push_back(match);
+        editorRegexEmit(&ps, root, true, &re->rev);
+        re->rev.push_back(match);
+        std::string run;
+        editorRegexLiteral(&ps, root, &run, &re->lit);
+        if (run.size() > re->lit.size())
+            re->lit = run;
+    }
+    if (ps.error)
+    {
+        *error = ps.error;
+        delete re;
+        return nullptr;
+    }
+    return re;
+}
+
+void editorRegexDFAInit(reDFA *d, const reRegex *re, const std::vector<reInst> *code, bool unanchored)
+{
+    d->re = re;
+    d->code = code;
+    d->unanchored = unanchored;
+    d->states.clear();
+    d->ids.clear();
+    d->next.clear();
+    d->match.clear();
+    d->match_end.clear();
+    d->start[0] = d->start[1] = -1;
+}
+
+// Follow everything reachable from `stack` without consuming a byte, keeping
+// the instructions that consume one, wait for the line end, or match
+void editorRegexClosure(const std::vector<reInst> &code, std::vector<int> &stack, bool bol, bool eol, std::vector<int> *out)
+{
+    std::vector<char> seen(code.size(), 0);
+    out->clear();
+    while (!stack.empty())
+    {
+        int pc = stack.back();
+        stack.pop_back();
+        if (seen[pc])
+            continue;
+        seen[pc] = 1;
+        const reInst &in = code[pc];
+        if (in.op == RE_JMP)
+            stack.push_back(in.x);
+        else if (in.op == RE_SPLIT)
+        {
+            stack.push_back(in.y);
+            stack.push_back(in.x);
+        }
+        else if (in.op == RE_BOL)
+        {
+            if (bol)
+                stack.push_back(pc + 1);
+        }
+        else if (in.op == RE_EOL && eol)
+            stack.push_back(pc + 1);
+        else
+            out->push_back(pc);
+    }
+    std::sort(out->begin(), out->end());
+}
+
+int editorRegexState(reDFA *d, const std::vector<int> &pcs)
+{
+    std::map<std::vector<int>, int>::iterator it = d->ids.find(pcs);
+    if (it != d->ids.end())
+        return it->second;
+
+    const std::vector<reInst> &code = *d->code;
+    int id = d->states.size();
+    d->states.push_back(pcs);
+    d->ids[pcs] = id;
+    d->next.resize(d->next.size() + 256, -1);
+
+    bool match = false;
+    for (int pc : pcs)
+        match |= code[pc].op == RE_MATCH;
+    std::vector<int> stack(pcs), end;
+    editorRegexClosure(code, stack, false, true, &end);
+    bool match_end = false;
+    for (int pc : end)
+        match_end |= code[pc].op == RE_MATCH;
+    d->match.push_back(match);
+    d->match_end.push_back(match_end);
+    return id;
+}
+
+int editorRegexStart(reDFA *d, bool bol)
+{
+    if (d->start[bol] < 0)
+    {
+        std::vector<int> stack(1, 0), pcs;
+        editorRegexClosure(*d->code, stack, bol, false, &pcs);
+        d->start[bol] = editorRegexState(d, pcs);
+    }
+    return d->start[bol];
+}
+
+// State after reading byte `c` in state `s`, worked out on first use
+int editorRegexStep(reDFA *d, int s, unsigned char c)
+{
+    int t = d->next[s * 256 + c];
+    if (t >= 0)
+        return t;
+
+    const std::vector<reInst> &code = *d->code;
+    std::vector<int> stack, pcs;
+    for (int pc : d->states[s])
+        if (code[pc].op == RE_SET && d->re->sets[code[pc].x].test(c))
+            stack.push_back(pc + 1);
+    if (d->unanchored)
+        stack.push_back(0);
+    editorRegexClosure(code, stack, false, false, &pcs);
+
+    if ((int)d->states.size() >= EDILITE_RE_STATES)
+    {
+        // Start the cache over rather than let it grow; `s` is gone now
+        editorRegexDFAInit(d, d->re, d->code, d->unanchored);
+        return editorRegexState(d, pcs);
+    }
+    t = editorRegexState(d, pcs);
+    d->next[s * 256 + c] = t;
+    return t;
+}
+
+void editorRegexMatcherInit(reMatcher *m, const reRegex *re)
+{
+    editorRegexDFAInit(&m->fwd, re, &re->fwd, false);
+    editorRegexDFAInit(&m->rev, re, &re->rev, true);
+    editorRegexDFAInit(&m->any, re, &re->fwd, true);
+}
+
+// Start of the first line in [p, end) the pattern may match in, or nullptr.
+// One pass over the raw text, so lines that cannot match cost a table lookup
+// per byte. A '\r' might be where the line really ends, so it counts as one.
+const char *editorRegexFirstLine(reMatcher *m, const char *p, const char *end)
+{
+    reDFA *d = &m->any;
+    const char *line = p;
+    int s = editorRegexStart(d, true);
+    const int *next = d->next.data();
+    const char *match = d->match.data();
+    for (; p < end; p++)
+    {
+        unsigned char c = *p;
+        if (match[s])
+            return line;
+        if (c == '\n' || c == '\r')
+        {
+            if (d->match_end[s])
+                return line;
+            if (c == '\n')
+            {
+                line = p + 1;
+                s = editorRegexStart(d, true);
+                continue;
+            }
+        }
+        int t = next[s * 256 + c];
+        if (t < 0)
+        {
+            // New states may have moved the tables
+            t = editorRegexStep(d, s, c);
+            next = d->next.data();
+            match = d->match.data();
+        }
+        s = t;
+    }
+    return line < end && (d->match[s] || d->match_end[s]) ? line : nullptr;
+}
+
+// Mark every column of `text` a match can start at, in one pass of the
+// reversed pattern from the end of the line
+void editorRegexStarts(reMatcher *m, const char *text, int len)
+{
+    reDFA *d = &m->rev;
+    m->starts.assign(len + 1, 0);
+    int s = editorRegexStart(d, true);
+    for (int i = len;; i--)
+    {
+        m->starts[i] = d->match[s] || (i == 0 && d->match_end[s]);
+        if (i == 0)
+            break;
+        s = editorRegexStep(d, s, text[i - 1]);
+    }
+}
+
+// Length of the longest match starting at column `at`, or -1
+int editorRegexLongest(reMatcher *m, const char *text, int len, int at)
+{
+    reDFA *d = &m->fwd;
+    int s = editorRegexStart(d, at == 0);
+    int end = -1;
+    for (int j = at;; j++)
+    {
+        if (d->match[s])
+            end = j;
+        if (j == len)
+        {
+            if (d->match_end[s])
+                end = len;
+            break;
+        }
+        s = editorRegexStep(d, s, text[j]);
+        if (d->states[s].empty())
+            break;
+    }
+    return end < 0 ? -1 : end - at;
+}
+
+// Column of the first non-empty match at or after `from`, with its length
+// in `mlen`, or -1. editorRegexStarts() must have run on the same text.
+int editorRegexNext(reMatcher *m, const char *text, int len, int from, int *mlen)
+{
+    for (int i = from; i < len; i++)
+    {
+        if (!m->starts[i])
+            continue;
+        int n = editorRegexLongest(m, text, len, i);
+        if (n > 0)
+        {
+            *mlen = n;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*** find ***/
+// Substring search over raw text. The vector kernels compare the first and
+// last byte of the needle at 16 or 32 positions at once and only memcmp()
+// the middle where both agree, which is rare in ordinary text.
+const char *editorSearchScalar(const char *hay, size_t n, const char *needle, size_t m)
+{
+    return (const char *)memmem(hay, n, needle, m);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) const char *editorSearchSSE2(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m < 2)
+        return editorSearchScalar(hay, n, needle, m);
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(hay + i + bit + 1, needle + 1, m - 2))
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return editorSearchScalar(hay + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2"))) const char *editorSearchAVX2(const char *hay, size_t n, const char *needle, size_t m)
+{
+    if (m < 2)
+        return editorSearchScalar(hay, n, needle, m);
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(hay + i + bit + 1, needle + 1, m - 2))
+                return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return editorSearchSSE2(hay + i, n - i, needle, m);
+}
+#endif
+
+typedef const char *(*searchFn)(const char *, size_t, const char *, size_t);
+
+// Widest kernel the CPU supports
+searchFn editorSearchPick()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return editorSearchAVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return editorSearchSSE2;
+#endif
+    return editorSearchScalar;
+}
+
+// First occurrence of `needle` in `hay`, or null
+const char *editorSearch(const char *hay, size_t n, const char *needle, size_t m)
+{
+    static const searchFn fn = editorSearchPick(); // Safe to race on from search threads
+    return fn(hay, n, needle, m);
+}
+
+// Search rows [lo, hi) for `query`: the first row holding it when going
+// forward, the last when going backward. Returns the row and puts the
+// column and length of the first match in it into `col` and `mlen`, or
+// returns -1. A regex query goes row by row. Unloaded runs
+// are searched as one stretch of the mapping; a query cannot hold a line
+// break, so a match never crosses lines.
+int editorFindRows(const std::string &query, int lo, int hi, int direction, int *col, int *mlen)
+{
+    if (lo >= hi)
+        return -1;
+    if (E.find.regex)
+    {
+        if (!E.find.re)
+            return -1;
+        for (int j = 0; j < hi - lo; j++)
+        {
+            int at = direction > 0 ? lo + j : hi - 1 - j;
+            int len;
+            const char *text = editorRowText(at, &len);
+            editorRegexStarts(E.find.matcher, text, len);
+            if ((*col = editorRegexNext(E.find.matcher, text, len, 0, mlen)) >= 0)
+                return at;
+        }
+        return -1;
+    }
+    *mlen = query.size();
+    int k;
+    rowNode *n = editorNodeFind(direction > 0 ? lo : hi - 1, &k);
+    int at = (direction > 0 ? lo : hi - 1) - k; // First row of `n`
+    while (n && at < hi && at + n->lines > lo)
+    {
+        int first = at > lo ? 0 : lo - at;          // Rows of `n` inside the range
+        int last = at + n->lines < hi ? n->lines : hi - at;
+        if (n->line < 0)
+        {
+            int len;
+            const char *text = editorNodeText(n, 0, &len);
+            const char *match = editorSearch(text, len, query.data(), query.size());
+            if (match)
+            {
+                *col = match - text;
+                return at;
+            }
+        }
+        else
+        {
+            const char *base = E.map + E.lineoff[n->line + first];
+            size_t size = E.lineoff[n->line + last] - E.lineoff[n->line + first];
+            const char *match = editorSearch(base, size, query.data(), query.size());
+            // Going backward the last match of the stretch is wanted
+            const char *found = match;
+            while (direction < 0 && match)
+            {
+                found = match;
+                size_t skip = match + 1 - base;
+                match = editorSearch(match + 1, size - skip, query.data(), query.size());
+            }
+            if (found)
+            {
+                size_t off = found - E.map;
+                size_t *line = std::upper_bound(E.lineoff + n->line + first, E.lineoff + n->line + last, off) - 1;
+                int len;
+                const char *text = editorMapLine(line - E.lineoff, &len);
+                *col = editorSearch(text, len, query.data(), query.size()) - text;
+                return at + (line - E.lineoff - n->line);
+            }
+        }
+        if (direction > 0)
+        {
+            at += n->lines;
+            n = editorNodeNext(n);
+        }
+        else
+        {
+            n = editorNodePrev(n);
+            if (n)
+                at -= n->lines;
+        }
+    }
+    return -1;
+}
+
+// Regex matches in one line, which do not overlap
+void editorFindScanLine(reMatcher *m, const char *text, int len, int row, std::vector<findMatch> *out, long *total,
+                        bool count_only)
+{
+    editorRegexStarts(m, text, len);
+    int mlen;
+    for (int at = editorRegexNext(m, text, len, 0, &mlen); at >= 0; at = editorRegexNext(m, text, len, at + mlen, &mlen))
+    {
+        ++*total;
+        if (!count_only)
+        {
+            findMatch fm = {row, at, mlen};
+            out->push_back(fm);
+        }
+    }
+}
+
+// Append every match of the current query in the segment to `out`, with
+// overlapping literal matches included; `total` counts them. Once
+// `count_only` is set the matches are only counted. A regex query runs
+// through matcher `m`.
+void editorFindScan(const findSegment *seg, reMatcher *m, std::vector<findMatch> *out, long *total, bool count_only)
+{
+    const char *query = E.find.query;
+    int qlen = E.find.qlen;
+    if (m)
+    {
+        // Nothing to show for a pattern that can only match empty text
+        if (m->fwd.re->sets.empty())
+            return;
+        const std::string &lit = m->fwd.re->lit;
+        if (seg->line == (size_t)-1)
+        {
+            if (lit.empty() || editorSearch(seg->text, seg->size, lit.data(), lit.size()))
+                editorFindScanLine(m, seg->text, seg->size, seg->row, out, total, count_only);
+            return;
+        }
+        // Only lines holding the literal part of the pattern and passing the
+        // single forward pass go through the two that place the matches
+        const char *end = seg->text + seg->size;
+        size_t last = seg->line + seg->lines;
+        size_t line = seg->line;
+        while (line < last)
+        {
+            const char *from = E.map + E.lineoff[line];
+            const char *stop = end;
+            if (!lit.empty())
+            {
+                const char *hit = editorSearch(from, end - from, lit.data(), lit.size());
+                if (!hit)
+                    break;
+                while (E.lineoff[line + 1] <= (size_t)(hit - E.map))
+                    line++;
+                from = E.map + E.lineoff[line];
+                stop = E.map + E.lineoff[line + 1];
+            }
+            const char *at = editorRegexFirstLine(m, from, stop);
+            if (!at)
+            {
+                if (lit.empty())
+                    break;
+                line++;
+                continue;
+            }
+            while (E.lineoff[line + 1] <= (size_t)(at - E.map))
+                line++;
+            if (line >= last)
+                break;
+            int len;
+            const char *text = editorMapLine(line, &len);
+            editorFindScanLine(m, text, len, seg->row + (line - seg->line), out, total, count_only);
+            line++;
+        }
+        return;
+    }
+
+    const char *p = seg->text;
+    const char *end = seg->text + seg->size;
+    size_t line = seg->line;
+    while (p < end && (p = editorSearch(p, end - p, query, qlen)))
+    {
+        ++*total;
+        if (!count_only)
+        {
+            findMatch fm;
+            fm.len = qlen;
+            if (seg->line == (size_t)-1)
+            {
+                fm.row = seg->row;
+                fm.col = p - seg->text;
+            }
+            else
+            {
+                // Matches come in order, so the line only moves forward
+                size_t off = p - E.map;
+                while (E.lineoff[line + 1] <= off)
+                    line++;
+                fm.row = seg->row + (line - seg->line);
+                fm.col = off - E.lineoff[line];
+            }
+            out->push_back(fm);
+        }
+        p++;
+    }
+}
+
+void editorFindClear()
+{
+    free(E.find.query);
+    free(E.find.m);
+    delete E.find.re;
+    delete E.find.matcher;
+    E.find.query = nullptr;
+    E.find.qlen = 0;
+    E.find.regex = 0;
+    E.find.re = nullptr;
+    E.find.matcher = nullptr;
+    E.find.matchers.clear();
+    E.find.error = nullptr;
+    E.find.m = nullptr;
+    E.find.n = 0;
+    E.find.cap = 0;
+    E.find.total = 0;
+    E.find.done = true;
+    std::vector<findSegment>().swap(E.find.segs);
+    E.find.nextseg = 0;
+    E.find.narrow = 0;
+    E.find.narrowend = 0;
+    E.find.row = -1;
+    E.find.seekdir = 0;
+}
+
+void editorFindReserve(int n)
+{
+    if (n > E.find.cap || !E.find.m)
+    {
+        E.find.cap = n > 2 * E.find.cap ? n : 2 * E.find.cap;
+        if (E.find.cap < 16)
+            E.find.cap = 16;
+        E.find.m = (findMatch *)realloc(E.find.m, sizeof(findMatch) * E.find.cap);
+    }
+}
+
+// The index is still being built or narrowed
+bool editorFindPending()
+{
+    return E.find.query && !E.find.done;
+}
+
+// Start indexing `query` over the whole file. The rows are cut into
+// segments, which editorFindWork searches a batch at a time.
+void editorFindBuild(const std::string &query, int regex)
+{
+    editorFindClear();
+    E.find.query = strdup(query.c_str());
+    E.find.qlen = query.size();
+    E.find.regex = regex;
+    if (regex)
+    {
+        E.find.re = editorRegexCompile(query, &E.find.error);
+        if (!E.find.re)
+            return;
+        E.find.matcher = new reMatcher();
+        editorRegexMatcherInit(E.find.matcher, E.find.re);
+    }
+    if (E.gaprow)
+        editorRowCloseGap(E.gaprow); // Search threads read chars as is
+
+    // Rows and blocks of mapped lines lacking a trigram of the query, or of
+    // the literal a regex needs, are left out
+    std::vector<uint32_t> h;
+    uint64_t sign = 0;
+    if (!regex)
+        editorTrigramQuery(query.data(), query.size(), &h, &sign);
+    else if (E.find.re->lit.size() >= 3)
+        editorTrigramQuery(E.find.re->lit.data(), E.find.re->lit.size(), &h, &sign);
+
+    std::vector<findSegment> &segs = E.find.segs;
+    int at = 0;
+    for (rowNode *n = editorNodeFirst(); n; n = editorNodeNext(n))
+    {
+        if (n->line < 0)
+        {
+            if ((n->row.tri & sign) == sign)
+            {
+                findSegment seg = {at, n->row.chars, (size_t)n->row.size, (size_t)-1, 1};
+                segs.push_back(seg);
+            }
+        }
+        else
+        {
+            size_t end = n->line + n->lines;
+            size_t stop;
+            for (size_t line = editorTrigramNext(h, n->line, end, &stop); line < end;
+                 line = editorTrigramNext(h, stop, end, &stop))
+            {
+                // Lines up to EDILITE_FIND_SEGMENT bytes, and at least one, go together
+                for (size_t next; line < stop; line = next)
+                {
+                    next = std::upper_bound(E.lineoff + line + 1, E.lineoff + stop + 1, E.lineoff[line] + EDILITE_FIND_SEGMENT) -
+                           E.lineoff - 1;
+                    if (next == line)
+                        next = line + 1;
+                    int lines = next - line;
+                    findSegment seg = {at + (int)(line - n->line), E.map + E.lineoff[line],
+                                       E.lineoff[line + lines] - E.lineoff[line], line, lines};
+                    segs.push_back(seg);
+                }
+            }
+        }
+        at += n->lines;
+    }
+
+    unsigned nthreads = std::thread::hardware_concurrency();
+    E.find.batch = EDILITE_FIND_SEGMENT; // Grows while batches stay quick
+    E.find.matchers.resize(regex ? (nthreads < 1 ? 1 : nthreads) : 0); // Each thread builds its own DFA states
+    for (reMatcher &m : E.find.matchers)
+        editorRegexMatcherInit(&m, E.find.re);
+    E.find.done = false;
+}
+
+// Search the next segments, about E.find.batch bytes for each core.
+// Each core searches one contiguous share and the shares are put back
+// together in order, so the index stays sorted.
+void editorFindScanBatch()
+{
+    std::vector<findSegment> &segs = E.find.segs;
+    unsigned nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1)
+        nthreads = 1;
+    size_t first = E.find.nextseg;
+    size_t last = first;
+    size_t bytes = 0;
+    while (last < segs.size() && bytes < E.find.batch * nthreads)
+        bytes += segs[last++].size + 1;
+    E.find.nextseg = last;
+
+    // Threads only pay off once there is a fair amount to read
+    if (bytes < (1 << 20))
+        nthreads = 1;
+    bool regex = E.find.regex;
+    std::vector<std::vector<findMatch>> found(nthreads);
+    std::vector<long> totals(nthreads, 0);
+    std::vector<std::thread> threads;
+    std::atomic<long> seen(E.find.total); // Matches so far, to stop keeping them past the limit
+    size_t next = first;
+    size_t done = 0;
+    for (unsigned t = 0; t < nthreads; t++)
+    {
+        size_t from = next;
+        size_t goal = bytes / nthreads * (t + 1);
+        while (next < last && (done < goal || t + 1 == nthreads))
+            done += segs[next++].size + 1;
+        size_t to = next;
+        auto work = [&, from, to, t]()
+        {
+            for (size_t j = from; j < to; j++)
+            {
+                long before = totals[t];
+                editorFindScan(&segs[j], regex ? &E.find.matchers[t] : nullptr, &found[t], &totals[t],
+                               seen.load(std::memory_order_relaxed) > EDILITE_FIND_MAX);
+                seen.fetch_add(totals[t] - before, std::memory_order_relaxed);
+            }
+        };
+        // The last share is searched here while the others run
+        if (t + 1 == nthreads)
+            work();
+        else
+            threads.push_back(std::thread(work));
+    }
+    for (std::thread &th : threads)
+        th.join();
+
+    for (unsigned t = 0; t < nthreads; t++)
+        E.find.total += totals[t];
+    if (E.find.total > EDILITE_FIND_MAX)
+    {
+        // From here on the matches are only counted
+        free(E.find.m);
+        E.find.m = nullptr;
+        E.find.n = 0;
+        E.find.cap = 0;
+        return;
+    }
+    editorFindReserve(E.find.total);
+    for (unsigned t = 0; t < nthreads; t++)
+    {
+        std::copy(found[t].begin(), found[t].end(), &E.find.m[E.find.n]);
+        E.find.n += found[t].size();
+    }
+}
+
+// Every match of a literal query starts where a match of any prefix of it
+// does, so while typing the index only has to be narrowed down. Entries
+// not checked yet against the previous query move down after the ones
+// that were, and all of them are checked against the new one.
+void editorFindNarrow(const std::string &query)
+{
+    free(E.find.query);
+    E.find.query = strdup(query.c_str());
+    E.find.qlen = query.size();
+
+    int unchecked = E.find.narrowend - E.find.narrow;
+    if (unchecked > 0)
+        memmove(&E.find.m[E.find.n], &E.find.m[E.find.narrow], sizeof(findMatch) * unchecked);
+    E.find.narrowend = E.find.n + unchecked;
+    E.find.narrow = 0;
+    E.find.n = 0;
+    E.find.total = 0;
+    E.find.done = false;
+}
+
+// Check up to `count` more entries against the query. An entry's `len` is
+// how much of the query it was checked for, so only the rest is compared,
+// and unloaded rows are read straight from the mapping. A mapped line
+// still holds its line ending here, which a query never matches.
+void editorFindNarrowSome(int count)
+{
+    findIndex *f = &E.find;
+    int end = f->narrowend - f->narrow > count ? f->narrow + count : f->narrowend;
+    rowNode *n = nullptr;
+    int at = 0; // First row of `n`
+    for (int j = f->narrow; j < end; j++)
+    {
+        findMatch fm = f->m[j];
+        if (!n || fm.row >= at + n->lines)
+        {
+            // Entries are in order, so the row is most often in the next node
+            rowNode *next = n ? editorNodeNext(n) : nullptr;
+            if (next && fm.row < at + n->lines + next->lines)
+            {
+                at += n->lines;
+                n = next;
+            }
+            else
+            {
+                int k = 0;
+                n = editorNodeFind(fm.row, &k);
+                at = fm.row - k;
+            }
+        }
+        const char *text;
+        size_t len;
+        if (n->line < 0)
+        {
+            int size;
+            text = editorNodeText(n, 0, &size);
+            len = size;
+        }
+        else
+        {
+            size_t line = n->line + (fm.row - at);
+            text = E.map + E.lineoff[line];
+            len = E.lineoff[line + 1] - E.lineoff[line];
+        }
+        if (fm.col + (size_t)f->qlen <= len && !memcmp(&text[fm.col + fm.len], f->query + fm.len, f->qlen - fm.len))
+        {
+            fm.len = f->qlen;
+            f->m[f->n++] = fm;
+        }
+    }
+    f->narrow = end;
+    f->total = f->n;
+}
+
+// Carry on with the index for about `ms` milliseconds: entries left to
+// narrow come first, then the segments not searched yet. Batches that take
+// long, as with a query matching nearly everywhere, are made smaller, so
+// the last one does not run far past the time.
+void editorFindWork(int ms)
+{
+    long long slice = ms * 1000000LL;
+    long long until = editorNowNs() + slice;
+    while (editorFindPending())
+    {
+        long long start = editorNowNs();
+        if (E.find.narrow < E.find.narrowend)
+            editorFindNarrowSome(1 << 14);
+        else if (E.find.nextseg < E.find.segs.size())
+        {
+            editorFindScanBatch();
+            long long took = editorNowNs() - start;
+            if (took > slice / 4 && E.find.batch > EDILITE_FIND_SEGMENT)
+                E.find.batch /= 2;
+            else if (took < slice / 16 && E.find.batch < EDILITE_FIND_BATCH)
+                E.find.batch *= 2;
+        }
+        else
+        {
+            E.find.done = true;
+            std::vector<findSegment>().swap(E.find.segs);
+            break;
+        }
+        if (editorNowNs() >= until)
+            break;
+    }
+}
+
+// Index of the first match at or after (row, col)
+int editorFindLowerBound(int row, int col)
+{
+    int lo = 0, hi = E.find.n;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        const findMatch &fm = E.find.m[mid];
+        if (fm.row < row || (fm.row == row && fm.col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Index of the match at (row, col), or -1
+int editorFindMatchAt(int row, int col)
+{
+    int j = editorFindLowerBound(row, col);
+    if (j < E.find.n && E.find.m[j].row == row && E.find.m[j].col == col)
+        return j;
+    return -1;
+}
+
+// Edits keep the index in step: a changed row has its matches found again,
+// and rows after an inserted or deleted one move along
+void editorFindRowChanged(erow *row)
+{
+    if (!E.find.query)
+        return;
+    if (E.find.total > E.find.n || !E.find.done)
+    {
+        editorFindClear(); // Too many or not all in yet; found again on the next search
+        return;
+    }
+    int at = editorNodeIndex((rowNode *)row);
+    int first = editorFindLowerBound(at, 0);
+    int last = editorFindLowerBound(at + 1, 0);
+
+    if (E.gaprow == row)
+        editorRowCloseGap(row);
+    std::vector<findMatch> found;
+    long total = 0;
+    findSegment seg = {at, row->chars, (size_t)row->size, (size_t)-1, 1};
+    if (!E.find.regex || E.find.re)
+        editorFindScan(&seg, E.find.matcher, &found, &total, false);
+
+    int n = E.find.n - (last - first) + found.size();
+    editorFindReserve(n);
+    memmove(&E.find.m[first + found.size()], &E.find.m[last], sizeof(findMatch) * (E.find.n - last));
+    std::copy(found.begin(), found.end(), &E.find.m[first]);
+    E.find.n = n;
+    E.find.total = n;
+}
+
+// `count` loaded rows were inserted at `at`: the matches below move down
+// once and the new rows' matches go in with a single move of the index
+void editorFindRowsInserted(int at, int count)
+{
+    if (!E.find.query)
+        return;
+    if (E.find.total > E.find.n || !E.find.done)
+    {
+        editorFindClear();
+        return;
+    }
+    int first = editorFindLowerBound(at, 0);
+    for (int j = first; j < E.find.n; j++)
+        E.find.m[j].row += count;
+
+    std::vector<findMatch> found;
+    long total = 0;
+    if (!E.find.regex || E.find.re)
+    {
+        int k;
+        rowNode *node = editorNodeFind(at, &k);
+        for (int j = 0; j < count; j++, node = editorNodeNext(node))
+        {
+            erow *row = &node->row;
+            if (E.gaprow == row)
+                editorRowCloseGap(row);
+            findSegment seg = {at + j, row->chars, (size_t)row->size, (size_t)-1, 1};
+            editorFindScan(&seg, E.find.matcher, &found, &total, false);
+        }
+    }
+
+    int n = E.find.n + found.size();
+    editorFindReserve(n);
+    memmove(&E.find.m[first + found.size()], &E.find.m[first], sizeof(findMatch) * (E.find.n - first));
+    std::copy(found.begin(), found.end(), &E.find.m[first]);
+    E.find.n = n;
+    E.find.total = n;
+}
+
+void editorFindRowInserted(int at)
+{
+    editorFindRowsInserted(at, 1);
+}
+
+void editorFindRowsDeleted(int at, int count)
+{
+    if (!E.find.query)
+        return;
+    if (E.find.total > E.find.n || !E.find.done)
+    {
+        editorFindClear();
+        return;
+    }
+    int first = editorFindLowerBound(at, 0);
+    int last = editorFindLowerBound(at + count, 0);
+    std::copy(&E.find.m[last], &E.find.m[E.find.n], &E.find.m[first]);
+    E.find.n -= last - first;
+    E.find.total = E.find.n;
+    for (int j = first; j < E.find.n; j++)
+        E.find.m[j].row -= count;
+}
+
+void editorFindRowDeleted(int at)
+{
+    editorFindRowsDeleted(at, 1);
+}
+
+// Show the match the search waits for once the index has got to it: the
+// first at or after (seekrow, seekcol) going forward, else the last before
+// it, wrapping at the ends. A query with too many matches to index goes
+// by rows as before.
+void editorFindSeek()
+{
+    findIndex *f = &E.find;
+    if (!f->seekdir || !f->query)
+        return;
+    int current = -1;
+    int col = 0;
+    int mlen = 0;
+    if (f->total > f->n)
+    {
+        std::string query(f->query, f->qlen);
+        if (f->seekdir > 0)
+        {
+            int from = f->seekrow + (f->seekcol > 0);
+            current = editorFindRows(query, from, E.numrows, 1, &col, &mlen);
+            if (current < 0)
+                current = editorFindRows(query, 0, from, 1, &col, &mlen);
+        }
+        else
+        {
+            current = editorFindRows(query, 0, f->seekrow, -1, &col, &mlen);
+            if (current < 0)
+                current = editorFindRows(query, f->seekrow, E.numrows, -1, &col, &mlen);
+        }
+    }
+    else
+    {
+        int j = editorFindLowerBound(f->seekrow, f->seekcol) - (f->seekdir < 0);
+        if (j < 0 || j >= f->n)
+        {
+            if (!f->done)
+                return; // Not indexed that far yet
+            if (f->n == 0)
+            {
+                f->seekdir = 0;
+                return;
+            }
+            j = j < 0 ? f->n - 1 : 0;
+        }
+        current = f->m[j].row;
+        col = f->m[j].col;
+        mlen = f->m[j].len;
+    }
+    f->seekdir = 0;
+    if (current < 0)
+        return;
+
+    erow *row = editorRowAt(current);
+    f->row = current;
+    f->col = col;
+    E.cy = current;
+    E.cx = col;
+    E.rowoff = E.numrows;
+
+    // Highlight the search match in blue
+    E.matchrow = current;
+    E.matchrx = editorRowCxToRx(row, col);
+    E.matchend = editorRowCxToRx(row, col + mlen);
+}
+
+// While no key is waiting: index some more, and show the match it reaches
+void editorFindIdle()
+{
+    editorFindWork(EDILITE_FIND_SLICE);
+    editorFindSeek();
+    editorRefreshScreen();
+}
+
+// Shared by literal and regex search; `regex` tells which the query is.
+// A key only does EDILITE_FIND_SLICE of the indexing, so a big file keeps
+// up with typing; the event loop does the rest between keys.
+void editorFindUpdate(const std::string &query, int key, int regex)
+{
+    static int direction = 1;
+
+    // Take down the highlight of the previous match
+    E.matchrow = -1;
+
+    if (key == '\x1b') // Exit on Esc Key
+    {
+        direction = 1;
+        editorFindClear();
+        return;
+    }
+
+    if (key == '\r') // Exit on Enter key; the index stays for the status bar
+    {
+        E.find.row = -1;
+        E.find.seekdir = 0;
+        direction = 1;
+        return;
+    }
+    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    {
+        direction = 1;
+    }
+    else if (key == ARROW_LEFT || key == ARROW_UP)
+    {
+        direction = -1;
+    }
+    else
+    {
+        E.find.row = -1;
+        direction = 1;
+    }
+
+    if (E.find.row == -1)
+        direction = 1;
+    if (query.empty())
+    {
+        editorFindClear();
+        return;
+    }
+
+    // A literal query that only grew narrows the index it extends
+    if (!E.find.query || query != E.find.query || E.find.regex != regex)
+    {
+        if (!regex && E.find.query && !E.find.regex && E.find.total == E.find.n &&
+            query.size() > (size_t)E.find.qlen && !query.compare(0, E.find.qlen, E.find.query))
+            editorFindNarrow(query);
+        else
+            editorFindBuild(query, regex);
+    }
+
+    E.find.seekdir = direction;
+    E.find.seekrow = E.find.row == -1 ? 0 : E.find.row;
+    E.find.seekcol = E.find.row == -1 ? 0 : E.find.col + (direction > 0);
+    editorFindWork(EDILITE_FIND_SLICE);
+    editorFindSeek();
+}
+
+void editorFindCallback(const std::string &query, int key)
+{
+    EDILITE_PROBE(PROBE_FIND);
+    editorFindUpdate(query, key, 0);
+}
+
+void editorFindRegexCallback(const std::string &query, int key)
+{
+    editorFindUpdate(query, key, 1);
+}
+
+void editorFind(int regex)
+{
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    std::string query = regex ? editorPrompt("Regex: %s (Use Arrows & Enter to exit | Press Esc 3 times to exit)", editorFindRegexCallback)
+                              : editorPrompt("Search: %s (Use Arrows & Enter to exit | Press Esc 3 times to exit)", editorFindCallback);
+    if (query.empty())
+        return;
+    else
+    {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
     }
+}
 
-    int len;
-    std::string buffer = editorRowsToString(len);
-
-    std::ofstream file(E.filename, std::ios::out | std::ios::trunc);
-    if (file)
+// Header describing the file as it is on disk now
+void editorJournalHeader(journalHeader *h)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "EDJ1", 4);
+    struct stat st;
+    if (stat(E.filename, &st) == 0)
     {
-        file.write(buffer.c_str(), len);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk... File saved successfully", len);
+        h->size = st.st_size;
+        h->mtime_sec = st.st_mtim.tv_sec;
+        h->mtime_nsec = st.st_mtim.tv_nsec;
+        h->ino = st.st_ino;
     }
-    else
+}
+
+bool editorJournalVarintAt(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
     {
-        editorSetStatusMessage("Can't save! I/O error");
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
     }
+    return false;
 }
 
-/*** find ***/
-void editorFindCallback(const std::string &query, int key)
+// Apply the records in `p`, up to the first one that was cut short by a
+// crash or does not fit the rows; returns how many bytes were applied
+size_t editorJournalReplay(const unsigned char *start, const unsigned char *end, int *count)
 {
-    static int last_match = -1;
-    static int direction = 1;
-    static int saved_hl_line = -1;
-    static unsigned char *saved_hl = nullptr;
-
-    // Restore previous hl if needed
-    if (saved_hl)
+    const unsigned char *p = start;
+    const unsigned char *good = start;
+    E.journal.replaying = true;
+    while (p < end)
     {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = nullptr;
-        // saved_hl_line = -1;
+        int op = *p++;
+        uint64_t a, b, len;
+        if (!editorJournalVarintAt(&p, end, &a) || !editorJournalVarintAt(&p, end, &b) ||
+            !editorJournalVarintAt(&p, end, &len) || len > (uint64_t)(end - p))
+            break;
+        const char *s = (const char *)p;
+        p += len;
+
+        bool row_ok = a < (uint64_t)E.numrows;
+        int size = row_ok ? editorRowAt(a)->size : 0;
+        if (op == J_INSERT && row_ok && b <= (uint64_t)size)
+            editorRowInsertString(editorRowAt(a), b, s, len);
+        else if (op == J_DELETE_CHAR && row_ok && b < (uint64_t)size)
+            editorRowDelChar(editorRowAt(a), b);
+        else if (op == J_TRUNCATE && row_ok && b <= (uint64_t)size)
+            editorRowTruncate(editorRowAt(a), b);
+        else if (op == J_INSERT_ROW && a <= (uint64_t)E.numrows)
+            editorInsertRow(a, s, len);
+        else if (op == J_DELETE_ROW && row_ok)
+            editorDelRow(a);
+        else if (op == J_DELETE && row_ok && b + len <= (uint64_t)size)
+            editorRowDeleteString(editorRowAt(a), b, len);
+        else if (op == J_INSERT_ROWS && a <= (uint64_t)E.numrows && b <= len / sizeof(uint32_t) && editorRowListValid(s, len, b))
+            editorInsertRows(a, b, s, len);
+        else if (op == J_DELETE_ROWS && b > 0 && a + b <= (uint64_t)E.numrows)
+            editorDelRows(a, b);
+        else
+            break;
+        good = p;
+        (*count)++;
     }
+    E.journal.replaying = false;
+    return good - start;
+}
 
-    if (key == '\x1b') // Exit on Esc Key
-    {
-        last_match = -1;
-        direction = 1;
+// Start journaling the file just opened or saved under a new name. A
+// journal left behind for this same version of the file is replayed first.
+void editorJournalOpen()
+{
+    editJournal *j = &E.journal;
+    if (j->fd != -1 || !E.filename)
         return;
+    journalHeader now;
+    editorJournalHeader(&now);
+    if (E.bench)
+    {
+        // A replay journals into a file of its own, so a real swap file is
+        // neither replayed into the buffer nor removed at the end
+        const char *dir = getenv("TMPDIR");
+        dir = dir && *dir ? dir : "/tmp";
+        j->path = (char *)malloc(strlen(dir) + 24);
+        sprintf(j->path, "%s/.ediLite-bench-XXXXXX", dir);
+        j->fd = mkstemp(j->path);
     }
-
-    if (key == '\r') // Exit on Enter key and reset saved_hl state
+    else
     {
-        last_match = -1;
-        direction = 1;
-        free(saved_hl);
-        saved_hl = nullptr;
-        return;
+        const char *slash = strrchr(E.filename, '/');
+        int dirlen = slash ? slash - E.filename + 1 : 0;
+        j->path = (char *)malloc(strlen(E.filename) + 8);
+        sprintf(j->path, "%.*s.%s.swp", dirlen, E.filename, E.filename + dirlen);
+        j->fd = open(j->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
     }
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+    if (j->fd == -1)
+        return;
+
+    struct stat st;
+    journalHeader old;
+    size_t keep = 0;
+    if (fstat(j->fd, &st) == 0 && (size_t)st.st_size > sizeof(old) &&
+        pread(j->fd, &old, sizeof(old), 0) == sizeof(old) && memcmp(&old, &now, sizeof(old)) == 0)
     {
-        direction = 1;
+        size_t len = st.st_size - sizeof(old);
+        unsigned char *rec = (unsigned char *)malloc(len);
+        if (pread(j->fd, rec, len, sizeof(old)) == (ssize_t)len)
+        {
+            int count = 0;
+            keep = editorJournalReplay(rec, rec + len, &count);
+            if (count)
+                editorSetStatusMessage("Recovered %d unsaved edits from %s", count, j->path);
+        }
+        free(rec);
     }
-    else if (key == ARROW_LEFT || key == ARROW_UP)
+
+    // Whatever does not belong to this file, or was cut short, goes
+    if (keep == 0)
     {
-        direction = -1;
+        ftruncate(j->fd, 0);
+        pwrite(j->fd, &now, sizeof(now), 0);
+        fdatasync(j->fd);
     }
     else
     {
-        last_match = -1;
-        direction = 1;
+        ftruncate(j->fd, sizeof(now) + keep);
     }
+    lseek(j->fd, 0, SEEK_END);
+}
 
-    if (last_match == -1)
-        direction = 1;
-    int current = last_match;
-    for (int i = 0; i < E.numrows; i++)
-    {
-        current += direction;
-        if (current == -1)
-            current = E.numrows - 1;
-        else if (current == E.numrows)
-            current = 0;
-
-        erow *row = &E.row[current];
-        const char *match = strstr(row->render, query.c_str());
-        if (match)
-        {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            // Save current hl state for restoration later
-            saved_hl_line = current;
-            saved_hl = (unsigned char *)malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-
-            // Highlight the search match in blue
-            memset(&row->hl[match - row->render], HL_MATCH, query.length());
-            break;
-        }
+// The file on disk now holds every edit: start the journal over
+void editorJournalReset()
+{
+    editJournal *j = &E.journal;
+    if (j->fd == -1)
+    {
+        editorJournalOpen();
+        return;
     }
+    j->len = 0;
+    j->sync_at = 0;
+    journalHeader now;
+    editorJournalHeader(&now);
+    ftruncate(j->fd, 0);
+    pwrite(j->fd, &now, sizeof(now), 0);
+    fdatasync(j->fd);
+    lseek(j->fd, 0, SEEK_END);
 }
 
-void editorFind()
+// On a deliberate quit the edits are not wanted back
+void editorJournalRemove()
 {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-
-    std::string query = editorPrompt("Search: %s (Use Arrows & Enter to exit | Press Esc 3 times to exit)", editorFindCallback);
-    if (query.empty())
+    editJournal *j = &E.journal;
+    if (j->fd == -1)
         return;
-    else
-    {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
-    }
+    close(j->fd);
+    unlink(j->path);
+    j->fd = -1;
 }
 
 // Open a file and load its contents into the editor
 void editorOpen(const char *filename)
 {
+    EDILITE_PROBE(PROBE_OPEN);
     // free(E.filename);
     E.filename = strdup(filename);
 
-    editorSelectSyntaxHighlight();
+    // Rows are highlighted as they are drawn, once the file is in
+    if (editorMapFile(filename))
+    {
+        editorSelectSyntaxHighlight();
+        editorStartTrigrams();
+        editorJournalOpen();
+        return;
+    }
 
     FILE *fp = fopen(filename, "r");
     if (!fp)
@@ -911,23 +5884,29 @@ void editorOpen(const char *filename)
     size_t linecap = 0;
     ssize_t linelen;
 
+    // The file's own lines are not edits, so undo must not take them out
+    E.undo.applying = true;
     while ((linelen = getline(&line, &linecap, fp)) != -1)
     {
         while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
             linelen--;
         editorInsertRow(E.numrows, line, linelen);
     }
+    E.undo.applying = false;
 
     free(line);
     fclose(fp);
+    editorSelectSyntaxHighlight();
     E.dirty = 0;
+    editorJournalOpen();
 }
 
 /*** Input ***/
 void editorMoveCursor(int key)
 {
-    // Check if the cursor is within a valid line; otherwise, set `row` to `nullptr`
-    erow *row = (E.cy >= E.numrows) ? nullptr : &E.row[E.cy];
+    // Check if the cursor is within a valid line; otherwise, set `size` to -1.
+    // Only sizes are needed, so rows passed over are not loaded.
+    int size = (E.cy >= E.numrows) ? -1 : editorRowSize(E.cy);
 
     switch (key)
     {
@@ -939,15 +5918,15 @@ void editorMoveCursor(int key)
         else if (E.cy > 0)
         {
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowSize(E.cy);
         }
         break;
     case ARROW_RIGHT:
-        if (row && E.cx < row->size)
+        if (size >= 0 && E.cx < size)
         {
             E.cx++;
         }
-        else if (row && E.cx == row->size)
+        else if (size >= 0 && E.cx == size)
         {
             E.cy++;
             E.cx = 0;
@@ -967,8 +5946,7 @@ void editorMoveCursor(int key)
         break;
     }
 
-    row = (E.cy >= E.numrows) ? nullptr : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
+    int rowlen = (E.cy >= E.numrows) ? 0 : editorRowSize(E.cy);
     if (E.cx > rowlen)
     {
         E.cx = rowlen;
@@ -979,6 +5957,8 @@ void editorProcessKeypress()
 {
     static int quit_times = EDILITE_QUIT_TIMES;
     int c = editorReadKey();
+    // Printable keys type; a run of them is undone in one step
+    editorUndoBegin(c == '\t' || c < 0 || (c >= ' ' && c < BACKSPACE));
 
     switch (c)
     {
@@ -986,6 +5966,13 @@ void editorProcessKeypress()
         editorInsertNewline();
         break;
 
+    case PASTE_START:
+    {
+        std::string text = editorReadPaste();
+        editorInsertText(text.data(), text.size());
+    }
+    break;
+
     case CTRL_KEY('q'):
         if (E.dirty && quit_times > 0)
         {
@@ -995,6 +5982,7 @@ void editorProcessKeypress()
             quit_times--;
             return;
         }
+        editorJournalRemove();
         write(STDOUT_FILENO, "\x1b[2J", 4);
         write(STDOUT_FILENO, "\x1b[H", 3);
         exit(0);
@@ -1004,13 +5992,21 @@ void editorProcessKeypress()
         editorSave();
         break;
 
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+
     case HOME_KEY:
         E.cx = 0;
         break;
 
     case END_KEY:
         if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         break;
 
     case BACKSPACE:
@@ -1048,11 +6044,22 @@ void editorProcessKeypress()
         break;
 
     case CTRL_KEY('f'):
-        editorFind();
+        editorFind(0);
+        break;
+
+    case CTRL_KEY('r'):
+        editorFind(1);
+        break;
+
+#ifdef EDILITE_PROFILE
+    case CTRL_KEY('p'):
+        editorProbeShown = !editorProbeShown;
         break;
+#endif
 
     case CTRL_KEY('l'):
     case '\x1b':
+    case PASTE_END:
         break;
 
     default:
@@ -1067,16 +6074,23 @@ std::string editorPrompt(const std::string &prompt, void (*callback)(const std::
     size_t buflen = 0;
     std::string buf;
     buf.reserve(128);
+    E.prompting = 1;
 
     while (true)
     {
-        editorSetStatusMessage(prompt.c_str(), buf.c_str());
-        editorRefreshScreen();
+        // Typed-ahead keys are taken in before the prompt is drawn again
+        if (!editorInputPending())
+        {
+            editorSetStatusMessage(prompt.c_str(), buf.c_str());
+            editorRefreshScreen();
+        }
 
         int c = editorReadKey();
+        bool edit = false;
 
         if (c == '\x1b')
         { // ESC to cancel
+            E.prompting = 0;
             editorSetStatusMessage("");
             if (callback)
                 callback(buf, c);
@@ -1086,6 +6100,7 @@ std::string editorPrompt(const std::string &prompt, void (*callback)(const std::
         { // Enter to confirm
             if (!buf.empty())
             {
+                E.prompting = 0;
                 editorSetStatusMessage("");
                 if (callback)
                     callback(buf, c);
@@ -1096,32 +6111,49 @@ std::string editorPrompt(const std::string &prompt, void (*callback)(const std::
         { // Backspace
             if (!buf.empty())
                 buf.pop_back();
+            edit = true;
         }
         else if (!iscntrl(c) && c < 128)
         { // Add printable character
             buf += c;
             buflen++;
+            edit = true;
         }
 
-        if (callback)
+        // and the callback only sees where typing stopped
+        if (callback && !(edit && editorInputPending()))
             callback(buf, c);
     }
 }
 
 /*** Output ***/
+// Width of the line numbers, worked out again only when the row count changes
+int editorGutterWidth()
+{
+    if (E.gutterrows != E.numrows)
+    {
+        int digits = 1;
+        for (int n = E.numrows; n >= 10; n /= 10)
+            digits++;
+        E.gutter = digits + 1;
+        E.gutterrows = E.numrows;
+    }
+    return E.gutter;
+}
+
 void editorScroll()
 {
     E.rx = 0;
 
     if (E.cy < E.numrows)
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
 
     if (E.cy < E.rowoff)
         E.rowoff = E.cy;
     if (E.cy >= E.rowoff + E.screenrows)
         E.rowoff = E.cy - E.screenrows + 1;
 
-    int lineNumberWidth = std::to_string(E.numrows).length() + 1;
+    int lineNumberWidth = editorGutterWidth();
 
     if (E.rx < E.coloff)
         E.coloff = E.rx;
@@ -1129,192 +6161,406 @@ void editorScroll()
         E.coloff = E.rx - E.screencols + lineNumberWidth + 1;
 }
 
-void editorDrawRows(std::string &ab)
+// Write `len` bytes of `s` into frame line `y` from column `x` on, clipped
+// to the screen; returns the column after them
+int editorFramePut(int y, int x, const char *s, int len, unsigned char style)
+{
+    scrCell *line = &E.frame[y * E.framecols];
+    for (int j = 0; j < len && x < E.framecols; j++, x++)
+    {
+        line[x].c = s[j];
+        line[x].style = style;
+    }
+    return x;
+}
+
+// Blank frame line `y` from column `x` on
+void editorFrameFill(int y, int x, unsigned char style)
+{
+    scrCell *line = &E.frame[y * E.framecols];
+    for (; x < E.framecols; x++)
+    {
+        line[x].c = ' ';
+        line[x].style = style;
+    }
+}
+
+void editorDrawRows()
 {
-    // Calculate line number width based on total lines
-    int lineNumberWidth = std::to_string(E.numrows).length() + 1;
+    EDILITE_PROBE(PROBE_DRAW);
+    int lineNumberWidth = editorGutterWidth();
+
+    // Only the rows on screen, and a few below for scrolling, need their
+    // highlighting up to date
+    int last = E.rowoff + E.screenrows + EDILITE_HL_LOOKAHEAD;
+    if (last > E.numrows)
+        last = E.numrows;
+    for (int j = E.rowoff; j < last; j++)
+        editorRowAt(j);
+    editorSyntaxResolve(last - 1);
 
     for (int y = 0; y < E.screenrows; y++)
     {
         int filerow = y + E.rowoff;
         if (filerow >= E.numrows)
         {
-            ab.append("~");
+            editorFramePut(y + 1, 0, "~", 1, HL_NORMAL);
         }
         else
         {
             // Display the line number with padding to keep alignment
-            char lineNumber[8];
-            snprintf(lineNumber, sizeof(lineNumber), "%*d ", lineNumberWidth, filerow + 1); // Line number with padding
-
-            ab.append("\x1b[93m"); // Set color to bright yellow
-            ab.append(lineNumber); // Append line number to the left of each line
-            ab.append("\x1b[39m"); // Reset color to default
-
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            if (len > E.screencols - lineNumberWidth - 1)
-                len = E.screencols - lineNumberWidth - 1;
-
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-
-            const char *current_color = nullptr;
-            for (int j = 0; j < len; j++)
+            char lineNumber[16];
+            int n = lineNumberWidth + 1;
+            memset(lineNumber, ' ', n);
+            int k = lineNumberWidth;
+            for (int num = filerow + 1; num > 0 && k > 0; num /= 10)
+                lineNumber[--k] = '0' + num % 10;
+            int x = editorFramePut(y + 1, 0, lineNumber, n, SCR_LINENO);
+
+            erow *row = editorRowAt(filerow);
+            int end = E.coloff + E.screencols - lineNumberWidth - 1;
+            // A long row only keeps the highlighting of what is on screen
+            if (row->chunks)
+                editorChunkTrim(row, E.coloff, end);
+
+            // A control character shows reversed, in the colour of the text
+            // before it. The search match shows over the row's own colours.
+            unsigned char current = HL_NORMAL;
+            const char *c;
+            const unsigned char *hl;
+            unsigned char style;
+            for (int at = E.coloff, len; at < end && (len = editorRowSpan(row, at, &c, &hl, &style)) > 0; at += len)
             {
-                if (iscntrl(c[j]))
-                {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    ab.append("\x1b[7m");
-                    ab.append(sym, 1);
-                    ab.append("\x1b[m");
-                    if (current_color)
-                    {
-                        ab.append(current_color); // Reapply the color after control character
-                    }
-                }
-                else if (hl[j] == HL_NORMAL)
+                if (len > end - at)
+                    len = end - at;
+                for (int j = 0; j < len; j++)
                 {
-                    if (current_color)
+                    unsigned char h = hl ? hl[j] : style;
+                    if (filerow == E.matchrow && at + j >= E.matchrx && at + j < E.matchend)
+                        h = HL_MATCH;
+                    if (iscntrl(c[j]))
                     {
-                        ab.append("\x1b[39m"); // Reset color
-                        current_color = nullptr;
+                        char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+                        x = editorFramePut(y + 1, x, &sym, 1, current | SCR_REVERSE);
                     }
-                    ab.append(1, c[j]);
-                }
-                else
-                {
-                    const char *color_code = editorSyntaxToColor(hl[j]);
-                    if (color_code != current_color)
+                    else
                     {
-                        ab.append(color_code); // Apply the custom color
-                        current_color = color_code;
+                        current = h;
+                        x = editorFramePut(y + 1, x, &c[j], 1, h);
                     }
-                    ab.append(1, c[j]);
                 }
             }
-            ab.append("\x1b[39m");
         }
-        ab.append("\x1b[K");
-        ab.append("\r\n");
     }
 }
 
-void editorDrawTopStatusBar(std::string &ab)
+void editorDrawTopStatusBar()
 {
-    ab.append("\x1b[7m"); // Invert colors for the status bar
-    std::string editor_name = std::string("EdiLite Text Editor -- version ") + EDILITE_VERSION;
-    // const char *editor_name = editor_name.c_str();
+    editorFrameFill(0, 0, SCR_REVERSE); // Invert colors for the status bar
+    static const char editor_name[] = "EdiLite Text Editor -- version " EDILITE_VERSION;
+    int len = sizeof(editor_name) - 1;
 
-    int len = editor_name.length();
     int padding = (E.screencols - len) / 2; // Center-align the text
-    if (padding > 0)
+    editorFramePut(0, padding > 0 ? padding : 0, editor_name, len, SCR_REVERSE);
+}
+
+void editorDrawStatusBar()
+{
+    int y = E.screenrows + 1;
+    editorFrameFill(y, 0, SCR_REVERSE); // Invert colors
+    char status[80], rstatus[80];
+    int len = snprintf(status, sizeof(status), "\"%.20s\" - %d lines",
+                       E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
+
+    // Where the cursor is among the matches of the last search
+    char match[40] = "";
+    // A + marks a count that is still going up
+    const char *more = E.find.done ? "" : "+";
+    if (E.find.error)
+        snprintf(match, sizeof(match), "bad regex: %s | ", E.find.error);
+    else if (E.find.query && E.find.total > E.find.n)
+        snprintf(match, sizeof(match), "%ld%s matches | ", E.find.total, more);
+    else if (E.find.query && editorFindMatchAt(E.cy, E.cx) >= 0)
+        snprintf(match, sizeof(match), "match %d of %d%s | ", editorFindMatchAt(E.cy, E.cx) + 1, E.find.n, more);
+    else if (E.find.query && !E.find.done)
+        snprintf(match, sizeof(match), "searching | ");
+    else if (E.find.query && E.find.n == 0)
+        snprintf(match, sizeof(match), "no matches | ");
+    int rlen = snprintf(rstatus, sizeof(rstatus), " %s%s | %d/%d", match, E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+    if (len > E.screencols)
+        len = E.screencols;
+    editorFramePut(y, 0, status, len, SCR_REVERSE);
+    if (E.screencols - len >= rlen)
+        editorFramePut(y, E.screencols - rlen, rstatus, rlen, SCR_REVERSE);
+}
+
+void editorDrawMessageBar()
+{
+    int msglen = strlen(E.statusmsg);
+    if (msglen && (E.prompting || time(nullptr) - E.statusmsg_time < EDILITE_MSG_TIMEOUT))
+        editorFramePut(E.screenrows + 3, 0, E.statusmsg, msglen, HL_NORMAL);
+}
+
+#ifdef EDILITE_PROFILE
+// The latency probes, and the heap allocations of the last frame, in a box
+// at the top right of the text
+void editorDrawProbes()
+{
+    char line[96];
+    int width = snprintf(line, sizeof(line), "%-10s %8s %8s %8s %8s %8s ", "probe", "count", "p50", "p90", "p99", "max");
+    int x = E.framecols > width ? E.framecols - width : 0;
+    int y = 1;
+    editorFramePut(y++, x, line, width, SCR_REVERSE);
+    for (int id = 0; id < PROBES && y <= E.screenrows; id++)
     {
-        for (int i = 0; i < padding; i++)
-        {
-            ab.append(" ");
-        }
+        int n = editorProbeLine(line, sizeof(line), id);
+        editorFrameFill(y, x, SCR_REVERSE);
+        editorFramePut(y++, x, line, n, SCR_REVERSE);
+    }
+    if (y <= E.screenrows)
+    {
+        int n = snprintf(line, sizeof(line), "heap allocations last frame: %lu", E.frameallocs);
+        editorFrameFill(y, x, SCR_REVERSE);
+        editorFramePut(y, x, line, n, SCR_REVERSE);
+    }
+}
+#endif
+
+void editorDrawHelpLine()
+{
+    int y = E.screenrows + 2;
+    editorFrameFill(y, 0, SCR_REVERSE); // Invert colors for emphasis
+    static const char helpText[] = "HELP: Ctrl-F = find | Ctrl-R = regex find | Ctrl-S = save | Ctrl-Z/Y = undo/redo | Ctrl-Q = quit";
+    editorFramePut(y, 0, helpText, sizeof(helpText) - 1, SCR_REVERSE);
+}
+
+// Start a new, blank frame. On a new screen size nothing is known about
+// what the terminal shows, so the next flush paints everything.
+void editorFrameBegin()
+{
+    int rows = E.screenrows + 4;
+    if (rows != E.framerows || E.screencols != E.framecols)
+    {
+        free(E.frame);
+        free(E.shown);
+        E.framerows = rows;
+        E.framecols = E.screencols;
+        E.frame = (scrCell *)malloc(sizeof(scrCell) * rows * E.screencols);
+        E.shown = (scrCell *)malloc(sizeof(scrCell) * rows * E.screencols);
+        for (int j = 0; j < rows * E.screencols; j++)
+            E.shown[j].style = SCR_UNKNOWN;
+        // Enough for a full repaint in a few colours; later frames reuse it
+        E.out.reserve(rows * E.screencols * 2 + 256);
     }
-    ab.append(editor_name);
+    for (int y = 0; y < rows; y++)
+        editorFrameFill(y, 0, HL_NORMAL);
+}
 
-    // Fill the remaining space
-    while (len + padding < E.screencols)
+// Look up the colour escape of each style once
+void editorFrameInitStyles()
+{
+    for (int j = 0; j < SCR_REVERSE; j++)
     {
-        ab.append(" ");
-        len++;
+        const char *seq = j == SCR_LINENO ? "\x1b[93m" : j == HL_NORMAL ? "\x1b[39m" : editorSyntaxToColor(j);
+        E.styles[j].seq = seq;
+        E.styles[j].len = strlen(seq);
     }
+}
 
-    ab.append("\x1b[m\r\n"); // Reset formatting and move to the next line
+// Switch the terminal from drawing cells in style `from` to style `to`
+void editorFrameStyle(std::string &ab, unsigned char from, unsigned char to)
+{
+    if (from == to)
+        return;
+    if (from == SCR_UNKNOWN || (from & SCR_REVERSE) != (to & SCR_REVERSE))
+    {
+        ab.append(to & SCR_REVERSE ? "\x1b[0;7m" : "\x1b[m");
+        from = to & SCR_REVERSE;
+    }
+    unsigned char fg = to & ~SCR_REVERSE;
+    if ((from & ~SCR_REVERSE) == fg)
+        return;
+    ab.append(E.styles[fg].seq, E.styles[fg].len);
 }
 
-void editorDrawStatusBar(std::string &ab)
+// Whether a frame line holds bytes that may not take one column each
+bool editorFrameWide(const scrCell *line)
 {
-    ab.append("\x1b[7m"); // Invert colors
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "\"%.20s\" - %d lines",
-                       E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
+    for (int x = 0; x < E.framecols; x++)
+    {
+        if ((unsigned char)line[x].c >= 0x80)
+            return true;
+    }
+    return false;
+}
 
-    int rlen = snprintf(rstatus, sizeof(rstatus), " %s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
-    if (len > E.screencols)
-        len = E.screencols;
-    ab.append(status);
-    while (len < E.screencols)
+// Write out only what changed since the last frame. When the view scrolled
+// the terminal moves the text rows itself first. Then each line gets its
+// runs of changed cells, and a run reaching the blank end of a line is
+// finished with one erase.
+void editorFrameFlush(std::string &ab)
+{
+    int cols = E.framecols;
+    bool unknown = E.shown[0].style == SCR_UNKNOWN;
+    if (unknown)
     {
-        if (E.screencols - len == rlen)
+        ab.append("\x1b[m\x1b[2J");
+        for (int j = 0; j < E.framerows * cols; j++)
         {
-            ab.append(rstatus);
-            break;
+            E.shown[j].c = ' ';
+            E.shown[j].style = HL_NORMAL;
+        }
+    }
+
+    int d = E.rowoff - E.shownrowoff;
+    int n = d > 0 ? d : -d;
+    if (!unknown && n > 0 && n < E.screenrows)
+    {
+        char buf[48];
+        snprintf(buf, sizeof(buf), "\x1b[m\x1b[2;%dr\x1b[%d%c\x1b[r", E.screenrows + 1, n, d > 0 ? 'S' : 'T');
+        ab.append(buf);
+        scrCell *text = &E.shown[cols];
+        int keep = E.screenrows - n;
+        scrCell *blank = text;
+        if (d > 0)
+        {
+            memmove(text, text + n * cols, sizeof(scrCell) * keep * cols);
+            blank = text + keep * cols;
         }
         else
         {
-            ab.append(" ");
-            len++;
+            memmove(text + n * cols, text, sizeof(scrCell) * keep * cols);
+        }
+        for (int j = 0; j < n * cols; j++)
+        {
+            blank[j].c = ' ';
+            blank[j].style = HL_NORMAL;
         }
     }
-    ab.append("\x1b[m"); // Reset to normal formatting
-    ab.append("\r\n");
-}
+    E.shownrowoff = E.rowoff;
 
-void editorDrawMessageBar(std::string &ab)
-{
-    ab.append("\x1b[K"); // Clear the line
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols)
-        msglen = E.screencols;
-    if (msglen && time(nullptr) - E.statusmsg_time < 5)
-        ab.append(E.statusmsg, msglen);
-}
-
-void editorDrawHelpLine(std::string &ab)
-{
-    ab.append("\x1b[7m"); // Invert colors for emphasis
-    std::string helpText = "HELP: Ctrl-F = find | Ctrl-S = save | Ctrl-Q = quit";
-    int helpTextLen = helpText.length();
-    if (helpTextLen > E.screencols)
-        helpTextLen = E.screencols;
-    ab.append(helpText); // Add the help text
-    while (helpTextLen < E.screencols)
+    unsigned char style = SCR_UNKNOWN;
+    for (int y = 0; y < E.framerows; y++)
     {
-        ab.append(" "); // Fill the rest with spaces
-        helpTextLen++;
+        scrCell *now = &E.frame[y * cols];
+        scrCell *was = &E.shown[y * cols];
+        // Where the cells after a multi-byte character land is up to the
+        // terminal, so a line holding one is written whole
+        bool whole = editorFrameWide(now) || editorFrameWide(was);
+        int end = cols; // Cells from here on are blank
+        while (end > 0 && now[end - 1].c == ' ' && now[end - 1].style == HL_NORMAL)
+            end--;
+
+        int x = 0;
+        while (x < cols)
+        {
+            if (!whole && now[x].c == was[x].c && now[x].style == was[x].style)
+            {
+                x++;
+                continue;
+            }
+            // Short unchanged stretches are cheaper to write again than to
+            // move the cursor past
+            int last = x;
+            for (int k = x + 1; k < cols && k - last <= 8; k++)
+            {
+                if (whole || now[k].c != was[k].c || now[k].style != was[k].style)
+                    last = k;
+            }
+            char buf[32];
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+            ab.append(buf);
+            // Each run of one style goes out as a single span
+            int stop = last < end ? last + 1 : end;
+            while (x < stop)
+            {
+                editorFrameStyle(ab, style, now[x].style);
+                style = now[x].style;
+                int k = x + 1;
+                while (k < stop && now[k].style == style)
+                    k++;
+                size_t at = ab.size();
+                ab.resize(at + (k - x));
+                for (char *d = &ab[at]; x < k; x++)
+                    *d++ = now[x].c;
+            }
+            if (x <= last)
+            {
+                editorFrameStyle(ab, style, HL_NORMAL);
+                style = HL_NORMAL;
+                ab.append("\x1b[K");
+                x = cols;
+            }
+        }
     }
-    ab.append("\x1b[m"); // Reset colors
-    ab.append("\r\n");
+    editorFrameStyle(ab, style, HL_NORMAL);
+
+    scrCell *t = E.shown;
+    E.shown = E.frame;
+    E.frame = t;
 }
 
 void editorRefreshScreen()
 {
+    long long benchstart = E.bench ? editorNowNs() : 0;
     editorScroll();
 
-    std::string ab;
-
-    ab.append("\x1b[?25l"); // Hide the cursor
-
-    // Append escape sequences to clear the screen and move cursor to top-left
-    // ab.append("\x1b[2J");  // Clear the screen
-    ab.append("\x1b[H"); // Move cursor to the top-left corner
+    // Say once what the search index of a large file costs, when it is done
+    if (E.trigrams && !E.trigrams->reported && E.trigrams->built == E.trigrams->nblocks)
+    {
+        E.trigrams->reported = true;
+        editorSetStatusMessage("Search index ready: %zu KB", editorTrigramMemory() / 1024);
+    }
 
-    editorDrawTopStatusBar(ab);
-    editorDrawRows(ab);
-    editorDrawStatusBar(ab);
-    editorDrawHelpLine(ab);
-    editorDrawMessageBar(ab);
+#ifdef EDILITE_PROFILE
+    unsigned long allocs = editorHeapAllocs.load(std::memory_order_relaxed);
+#endif
+    editorFrameBegin();
+    editorDrawTopStatusBar();
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawHelpLine();
+    editorDrawMessageBar();
+#ifdef EDILITE_PROFILE
+    if (editorProbeShown)
+        editorDrawProbes();
+#endif
+
+    std::string &ab = E.out;
+    ab.clear(); // Keeps its capacity
 
-    // Calculate line number width dynamically
-    int lineNumberWidth = std::to_string(E.numrows).length() + 1;
+    ab.append("\x1b[?25l"); // Hide the cursor
+    editorFrameFlush(ab);
 
-    // Move the cursor back to the top-left corner
-    // ab.append("\x1b[H");
+    int lineNumberWidth = editorGutterWidth();
 
     char buf[32];
-    int welcomelen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 2, (E.rx - E.coloff) + lineNumberWidth + 2);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 2, (E.rx - E.coloff) + lineNumberWidth + 2);
     ab.append(buf);
 
     ab.append("\x1b[?25h"); // Hide the cursor
 
     // Write the buffer contents to standard output
-    write(STDOUT_FILENO, ab.c_str(), ab.size());
+    {
+        EDILITE_PROBE(PROBE_WRITE);
+        write(STDOUT_FILENO, ab.c_str(), ab.size());
+    }
+    if (E.bench)
+        editorBenchFrame(benchstart, ab.size());
+    editorUnloadRows(); // Once the frame is out
+#ifdef EDILITE_PROFILE
+    E.frameallocs = editorHeapAllocs.load(std::memory_order_relaxed) - allocs;
+    if (editorProbeKeyAt)
+    {
+        editorProbeRecord(PROBE_KEY, (uint64_t)editorNowNs() - editorProbeKeyAt);
+        editorProbeKeyAt = 0;
+    }
+#endif
+
+    if (E.hlworker)
+        E.hlworker->busy = false;
+    if (E.trigrams)
+        E.trigrams->busy = false;
 }
 
 void editorSetStatusMessage(const char *fmt, ...)
@@ -1326,14 +6572,244 @@ void editorSetStatusMessage(const char *fmt, ...)
     E.statusmsg_time = time(nullptr);
 }
 
-/*** Dynamic Window Screen Size ***/
-// Function to update screen size on window resize
-void handleWindowResize(int unused)
+/*** event loop ***/
+#ifndef __linux__
+// Without signalfd the handler only writes a byte down a pipe, which the
+// event loop reads like the signalfd
+int editorWinchPipe[2];
+
+void editorWinch(int)
 {
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
-        die("getWindowSize");
-    E.screenrows -= 4; // Adjust for reserved rows like status bar
-    editorRefreshScreen();
+    int saved = errno;
+    write(editorWinchPipe[1], "w", 1);
+    errno = saved;
+}
+#endif
+
+// Take SIGWINCH as a readable descriptor instead of running code in a
+// signal handler, and make the timer the loop wakes up for
+void editorInitEvents()
+{
+#ifdef __linux__
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    // Blocked before any thread starts, so every thread inherits it
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0)
+        die("pthread_sigmask");
+    E.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (E.sigfd == -1)
+        die("signalfd");
+    E.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (E.timerfd == -1)
+        die("timerfd_create");
+#else
+    if (pipe(editorWinchPipe) == -1)
+        die("pipe");
+    fcntl(editorWinchPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(editorWinchPipe[1], F_SETFL, O_NONBLOCK);
+    E.sigfd = editorWinchPipe[0];
+    signal(SIGWINCH, editorWinch);
+#endif
+}
+
+// When the loop next has to wake up by itself, or -1 for never
+long long editorNextDeadline()
+{
+    long long due = E.resize_at ? E.resize_at : -1;
+    if (editorFindPending())
+        return editorNowMs(); // Indexing goes on until a key comes
+    if (E.journal.sync_at && (due < 0 || E.journal.sync_at < due))
+        due = E.journal.sync_at;
+    if (E.statusmsg[0] && !E.prompting)
+    {
+        long long expire = editorNowMs() + (E.statusmsg_time + EDILITE_MSG_TIMEOUT - time(nullptr)) * 1000LL;
+        if (due < 0 || expire < due)
+            due = expire;
+    }
+    return due;
+}
+
+// Do what came due: sync the journal, redraw once a burst of resizes is
+// over, and take a status message down when it expires
+void editorRunTimers()
+{
+    if (E.journal.sync_at && editorNowMs() >= E.journal.sync_at)
+        editorJournalFlush(true);
+    if (E.resize_at && editorNowMs() >= E.resize_at)
+    {
+        E.resize_at = 0;
+        if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+            die("getWindowSize");
+        E.screenrows -= 4; // Adjust for reserved rows like status bar
+        editorRefreshScreen();
+    }
+    if (E.statusmsg[0] && !E.prompting && time(nullptr) - E.statusmsg_time >= EDILITE_MSG_TIMEOUT)
+    {
+        E.statusmsg[0] = '\0';
+        editorRefreshScreen();
+    }
+}
+
+// Sleep until a key can be read. Resizes and timers that come due in the
+// meantime are handled here, and a search index still being built is
+// worked on a slice at a time; nothing else wakes the editor up while it
+// is idle.
+void editorWaitInput()
+{
+    for (;;)
+    {
+        long long due = editorNextDeadline();
+        int timeout = -1;
+        if (due >= 0)
+        {
+            long long wait = due - editorNowMs();
+            timeout = wait > 0 ? wait : 0;
+        }
+#ifdef __linux__
+        // The timer is armed for the next deadline only, and a zero value
+        // would disarm it
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        if (due >= 0)
+        {
+            its.it_value.tv_sec = timeout / 1000;
+            its.it_value.tv_nsec = timeout % 1000 * 1000000 + 1;
+        }
+        timerfd_settime(E.timerfd, 0, &its, nullptr);
+        timeout = -1;
+#endif
+        struct pollfd pfd[3] = {{STDIN_FILENO, POLLIN, 0}, {E.sigfd, POLLIN, 0}, {E.timerfd, POLLIN, 0}};
+        int n = poll(pfd, E.timerfd >= 0 ? 3 : 2, timeout);
+        if (n == -1 && errno != EINTR)
+            die("poll");
+
+        char buf[128]; // Room for one signalfd_siginfo
+        if (n > 0 && (pfd[1].revents & POLLIN))
+        {
+            while (read(E.sigfd, buf, sizeof(buf)) > 0)
+                ;
+            E.resize_at = editorNowMs() + EDILITE_RESIZE_DELAY;
+        }
+        if (n > 0 && E.timerfd >= 0 && (pfd[2].revents & POLLIN))
+            read(E.timerfd, buf, sizeof(uint64_t));
+        editorRunTimers();
+        if (n > 0 && pfd[0].revents)
+        {
+#ifdef EDILITE_PROFILE
+            if (!editorProbeKeyAt)
+                editorProbeKeyAt = (uint64_t)editorNowNs();
+#endif
+            return;
+        }
+        // Nothing typed yet: get on with the search index
+        if (editorFindPending())
+            editorFindIdle();
+    }
+}
+
+/*** benchmark ***/
+// ediLite --bench ROWSxCOLS SCRIPT [FILE] replays the keys in SCRIPT on a
+// screen of that size, with no terminal, and prints one line: keys per
+// second, bytes written to the screen, frame times and what opening FILE
+// took. `make bench` runs it over canned scenarios.
+void editorBenchStart(const char *size, const char *script)
+{
+    benchRun *b = new benchRun();
+    if (sscanf(size, "%dx%d", &b->rows, &b->cols) != 2 || b->rows < 5 || b->cols < 20)
+    {
+        fprintf(stderr, "bad screen size %s, want ROWSxCOLS\n", size);
+        exit(1);
+    }
+    std::ifstream in(script, std::ios::binary);
+    if (!in)
+        die(script);
+    std::string keys((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    b->len = keys.size();
+    b->script = (char *)malloc(b->len + 1);
+    memcpy(b->script, keys.data(), b->len);
+
+    const char *base = strrchr(script, '/');
+    b->name = strdup(base ? base + 1 : script);
+    char *dot = strrchr((char *)b->name, '.');
+    if (dot && dot != b->name)
+        *dot = '\0';
+
+    // Frames are still built and written, only nobody sees them
+    b->out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (b->out == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1)
+        die("/dev/null");
+    close(null);
+    b->start = editorNowNs();
+    E.bench = b;
+}
+
+void editorBenchOpen(const char *filename)
+{
+    long long t = editorNowNs();
+    editorOpen(filename);
+    E.bench->open = editorNowNs() - t;
+    E.bench->start = editorNowNs();
+}
+
+void editorBenchFrame(long long start, size_t bytes)
+{
+    long long now = editorNowNs();
+    E.bench->frames.push_back(now - start);
+    if (E.bench->keyat)
+        E.bench->paints.push_back(now - E.bench->keyat);
+    E.bench->keyat = 0;
+    E.bench->bytes += bytes;
+}
+
+// Percentile `q` of the times in `v`, in milliseconds; sorts `v`
+double editorBenchPercentile(std::vector<long long> &v, double q)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(v.size() * q))] / 1e6;
+}
+
+// The script has run out: report and leave, taking the replay's own journal along
+void editorBenchFinish()
+{
+    benchRun *b = E.bench;
+    double secs = (editorNowNs() - b->start) / 1e9;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    long rss = ru.ru_maxrss >> 20; // Bytes there
+#else
+    long rss = ru.ru_maxrss >> 10;
+#endif
+    dprintf(b->out, "%-8s %7ld keys %9.0f keys/s %11llu bytes  frame p50 %7.3f ms  p99 %7.3f ms  "
+                    "key p50 %7.3f ms  p99 %7.3f ms  open %8.2f ms  rss %5ld MB\n",
+            b->name, b->keys, secs > 0 ? b->keys / secs : 0, b->bytes, editorBenchPercentile(b->frames, 0.5),
+            editorBenchPercentile(b->frames, 0.99), editorBenchPercentile(b->paints, 0.5),
+            editorBenchPercentile(b->paints, 0.99), b->open / 1e6, rss);
+    editorJournalRemove();
+    exit(0);
+}
+
+// editorReadByte() for a replay: the script in pieces the size of a read()
+int editorBenchReadByte(char *c, int timeout)
+{
+    benchRun *b = E.bench;
+    if (b->pos == b->len)
+    {
+        if (timeout >= 0)
+            return 0;
+        editorBenchFinish();
+    }
+    size_t n = std::min(b->len - b->pos, sizeof(E.input.data));
+    memcpy(E.input.data, b->script + b->pos, n);
+    b->pos += n;
+    E.input.len = n;
+    E.input.pos = 0;
+    *c = E.input.data[E.input.pos++];
+    return 1;
 }
 
 /*** Init ***/
@@ -1345,14 +6821,79 @@ void initEditor()
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = nullptr;
+    E.rows = nullptr;
     E.filename = nullptr;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.dirty = 0;
     E.syntax = nullptr;
-
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    E.map = nullptr;
+    E.mapsize = 0;
+    E.lineoff = nullptr;
+    E.gaprow = nullptr;
+    E.maplines = 0;
+    E.hlblock = nullptr;
+    E.hlworker = nullptr;
+    E.trigrams = nullptr;
+    E.keywords.slots = nullptr;
+    E.keywords.mask = 0;
+    E.keywords.seed = 0;
+    E.keywords.maxlen = 0;
+    E.find.query = nullptr;
+    E.find.qlen = 0;
+    E.find.regex = 0;
+    E.find.re = nullptr;
+    E.find.matcher = nullptr;
+    E.find.error = nullptr;
+    E.find.m = nullptr;
+    E.find.n = 0;
+    E.find.cap = 0;
+    E.find.total = 0;
+    E.find.done = true;
+    E.find.nextseg = 0;
+    E.find.batch = EDILITE_FIND_BATCH;
+    E.find.narrow = 0;
+    E.find.narrowend = 0;
+    E.find.row = -1;
+    E.find.col = 0;
+    E.find.seekdir = 0;
+    E.matchrow = -1;
+    E.input.len = 0;
+    E.input.pos = 0;
+    E.prompting = 0;
+    E.sigfd = -1;
+    E.timerfd = -1;
+    E.resize_at = 0;
+    E.journal.fd = -1;
+    E.journal.path = nullptr;
+    E.journal.buf = nullptr;
+    E.journal.len = 0;
+    E.journal.cap = 0;
+    E.journal.sync_at = 0;
+    E.journal.replaying = false;
+    E.frame = nullptr;
+    E.shown = nullptr;
+    E.framerows = 0;
+    E.framecols = 0;
+    E.shownrowoff = 0;
+    E.gutter = 0;
+    E.gutterrows = -1;
+#ifdef EDILITE_PROFILE
+    E.frameallocs = 0;
+#endif
+    for (int j = 0; j < EDILITE_SLAB_CLASSES; j++)
+        E.slab.free[j] = nullptr;
+    E.slab.next = nullptr;
+    E.slab.left = 0;
+    E.slab.bytes = 0;
+    editorFrameInitStyles();
+
+    if (E.bench)
+    {
+        E.screenrows = E.bench->rows;
+        E.screencols = E.bench->cols;
+    }
+    else if (getWindowSize(&E.screenrows, &E.screencols) == -1)
         die("getWindowSize");
 
     E.screenrows -= 4; // Reserve 3 rows for the status bar
@@ -1360,15 +6901,30 @@ void initEditor()
 
 int main(int argc, char *argv[])
 {
-    std::cout << "Welcome to the text Editor\n";
-
-    enableRawMode();
+    if (argc >= 4 && strcmp(argv[1], "--bench") == 0)
+    {
+        editorBenchStart(argv[2], argv[3]);
+        argc -= 3;
+        argv += 3;
+    }
+    else
+    {
+        std::cout << "Welcome to the text Editor\n";
+        enableRawMode();
+    }
     initEditor();
+#ifdef EDILITE_PROFILE
+    atexit(editorProbeDump);
+#endif
 
-    // Set up SIGWINCH to call handleWindowResize when window size changes
-    signal(SIGWINCH, handleWindowResize);
+    // Window size changes are picked up by the event loop
+    editorInitEvents();
 
-    if (argc >= 2)
+    if (argc >= 2 && E.bench)
+    {
+        editorBenchOpen(argv[1]);
+    }
+    else if (argc >= 2)
     {
         editorOpen(argv[1]);
     }
@@ -1377,7 +6933,10 @@ int main(int argc, char *argv[])
     while (1)
     {
         editorRefreshScreen();
-        editorProcessKeypress();
+        // Apply every key already typed or pasted before drawing again
+        do
+            editorProcessKeypress();
+        while (editorInputPending());
     }
     return 0;
 }